@@ -0,0 +1,232 @@
+#include "adaptivemesh.h"
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <iostream>
+#include "stats.h"
+
+// the adaptive mesh is a right-triangulated irregular network (RTIN) over the same lat lon grid the uniform mesh uses.
+// the grid is covered by a square of 2^k + 1 vertices, and triangles are split along their hypotenuse until
+// the height at the midpoint of the hypotenuse is within the maximum error of the interpolated height.
+// because both triangles sharing a hypotenuse read the same error, neighbouring triangles always agree and there are no cracks.
+// only the part of the square the grid covers is stored or visited, so a long thin strip costs no more than its vertices
+
+struct RTIN {
+    const float *heights;
+    int width;
+    int height;
+    int tileSize;
+    // the error of every grid vertex as a hypotenuse midpoint, stored like the heights
+    std::vector<float> errors;
+    std::vector<std::array<int64_t, 3>> triangles;
+};
+
+// where the triangle lies relative to the grid, which only covers [0, width - 1] x [0, height - 1] of the square
+enum TriangleCoverage { TRIANGLE_INSIDE, TRIANGLE_STRADDLES, TRIANGLE_OUTSIDE };
+
+static TriangleCoverage triangle_coverage(RTIN *rtin, int ax, int ay, int bx, int by, int cx, int cy) {
+    int max_x = rtin->width - 1;
+    int max_y = rtin->height - 1;
+    if (std::min({ax, bx, cx}) >= max_x || std::min({ay, by, cy}) >= max_y) {
+        return TRIANGLE_OUTSIDE;
+    }
+    if (std::max({ax, bx, cx}) > max_x || std::max({ay, by, cy}) > max_y) {
+        return TRIANGLE_STRADDLES;
+    }
+    return TRIANGLE_INSIDE;
+}
+
+// midpoints off the grid only belong to triangles that straddle its edge, which always have to be split
+static float midpoint_error(RTIN *rtin, int x, int y) {
+    if (x >= rtin->width || y >= rtin->height) {
+        return INFINITY;
+    }
+    return rtin->errors[(int64_t)y * rtin->width + x];
+}
+
+// folds one triangle's error into the error of its hypotenuse midpoint, including the errors of its children unless
+// it is one of the smallest triangles. Triangles that straddle the edge of the grid get an infinite error
+static void update_error(RTIN *rtin, bool smallest, TriangleCoverage coverage, int ax, int ay, int bx, int by, int cx, int cy) {
+    int mx = (ax + bx) >> 1;
+    int my = (ay + by) >> 1;
+    if (mx >= rtin->width || my >= rtin->height) {
+        return;
+    }
+    float &middle_error = rtin->errors[(int64_t)my * rtin->width + mx];
+    if (coverage == TRIANGLE_STRADDLES) {
+        middle_error = INFINITY;
+        return;
+    }
+    float height_a = rtin->heights[(int64_t)ay * rtin->width + ax];
+    float height_b = rtin->heights[(int64_t)by * rtin->width + bx];
+    float height_m = rtin->heights[(int64_t)my * rtin->width + mx];
+    middle_error = std::max(middle_error, (float)fabs((height_a + height_b) / 2 - height_m));
+    if (!smallest) {
+        middle_error = std::max({middle_error, midpoint_error(rtin, (ax + cx) >> 1, (ay + cy) >> 1), midpoint_error(rtin, (bx + cx) >> 1, (by + cy) >> 1)});
+    }
+}
+
+// updates the errors of the triangles depth splits below the triangle with hypotenuse ab and right angle at c,
+// skipping every part of the square that is off the grid
+static void compute_level_errors(RTIN *rtin, int depth, bool smallest, int ax, int ay, int bx, int by, int cx, int cy) {
+    TriangleCoverage coverage = triangle_coverage(rtin, ax, ay, bx, by, cx, cy);
+    if (coverage == TRIANGLE_OUTSIDE) {
+        return;
+    }
+    if (depth == 0) {
+        update_error(rtin, smallest, coverage, ax, ay, bx, by, cx, cy);
+        return;
+    }
+    int mx = (ax + bx) >> 1;
+    int my = (ay + by) >> 1;
+    compute_level_errors(rtin, depth - 1, smallest, cx, cy, ax, ay, mx, my);
+    compute_level_errors(rtin, depth - 1, smallest, bx, by, cx, cy, mx, my);
+}
+
+// visits the triangles a level at a time from the smallest up, so the error of a midpoint includes the errors of all
+// the triangles below it on both sides of every hypotenuse before any bigger triangle reads it
+static void compute_errors(RTIN *rtin) {
+    rtin->errors.assign((size_t)rtin->width * rtin->height, 0.0f);
+    // the smallest triangles have a hypotenuse two vertices long, 2 log2(tileSize) - 1 splits below the two root triangles
+    int smallest_depth = -1;
+    for (int size = rtin->tileSize; size > 1; size >>= 1) {
+        smallest_depth += 2;
+    }
+    int size = rtin->tileSize;
+    for (int depth = smallest_depth; depth >= 0; depth--) {
+        compute_level_errors(rtin, depth, depth == smallest_depth, 0, 0, size, size, size, 0);
+        compute_level_errors(rtin, depth, depth == smallest_depth, size, size, 0, 0, 0, size);
+    }
+}
+
+// splits the triangle with hypotenuse ab and right angle at c until it is within max_error, then keeps it
+static void collect_triangles(RTIN *rtin, float max_error, int ax, int ay, int bx, int by, int cx, int cy) {
+    if (triangle_coverage(rtin, ax, ay, bx, by, cx, cy) == TRIANGLE_OUTSIDE) {
+        return;
+    }
+    int mx = (ax + bx) >> 1;
+    int my = (ay + by) >> 1;
+    if (abs(ax - cx) + abs(ay - cy) > 1 && midpoint_error(rtin, mx, my) > max_error) {
+        collect_triangles(rtin, max_error, cx, cy, ax, ay, mx, my);
+        collect_triangles(rtin, max_error, bx, by, cx, cy, mx, my);
+        return;
+    }
+    // keep the winding counter clockwise in lon lat, like the quads of the uniform mesh
+    int64_t a = (int64_t)ay * rtin->width + ax;
+    int64_t b = (int64_t)by * rtin->width + bx;
+    int64_t c = (int64_t)cy * rtin->width + cx;
+    if ((int64_t)(bx - ax) * (cy - ay) - (int64_t)(by - ay) * (cx - ax) > 0) {
+        rtin->triangles.push_back({a, b, c});
+    } else {
+        rtin->triangles.push_back({a, c, b});
+    }
+}
+
+int create_adaptive_mesh(MoonSurfaceOptions meshOptions, WorkPool *pool, DEMManager *demManager) {
+    int vertices_height = floor(meshOptions.latlon_extent[0] * meshOptions.verts_per_degree) + 1;
+    int vertices_width = floor(meshOptions.latlon_extent[1] * meshOptions.verts_per_degree) + 1;
+
+    int64_t origin[2];
+    std::unique_ptr<SampleCache> sampleCache = open_sample_cache(&meshOptions, demManager, origin);
+
+    std::cout << "Sampling height field" << std::endl;
+    PhaseTimer sampleTimer("sample");
+    std::vector<float> lons(vertices_width);
+    for (int lon_idx = 0; lon_idx < vertices_width; lon_idx++) {
+        lons[lon_idx] = meshOptions.min_latlon[1] + lon_idx / meshOptions.verts_per_degree;
+    }
+    float center_elevation = demManager->sample(meshOptions.latlon[0], meshOptions.latlon[1]);
+    std::vector<float> radii((size_t)vertices_width * vertices_height);
+    if (sampleCache) {
+        sampleCache->fill(pool, origin[0], origin[1], vertices_height, vertices_width);
+    }
+    pool->run(vertices_height, [&](size_t lat_idx, int worker) {
+        (void)worker;
+        float lat = meshOptions.min_latlon[0] + lat_idx / meshOptions.verts_per_degree;
+        if (sampleCache) {
+            sampleCache->sampleRow(radii.data() + lat_idx * vertices_width, origin[0] + lat_idx, origin[1], vertices_width);
+        } else {
+            demManager->sampleRow(radii.data() + lat_idx * vertices_width, lat, lons.data(), vertices_width, 1.0 / meshOptions.verts_per_degree);
+        }
+    });
+    sampleTimer.stop();
+
+    // errors are measured on heights relative to the center, which keeps them precise in floats
+    std::vector<float> heights(radii.size());
+    for (size_t idx = 0; idx < radii.size(); idx++) {
+        heights[idx] = radii[idx] - center_elevation;
+    }
+
+    std::cout << "Triangulating to within " << meshOptions.max_error << " m" << std::endl;
+    PhaseTimer triangulateTimer("triangulate");
+    RTIN rtin;
+    rtin.heights = heights.data();
+    rtin.width = vertices_width;
+    rtin.height = vertices_height;
+    rtin.tileSize = 1;
+    while (rtin.tileSize < std::max(vertices_width, vertices_height) - 1) {
+        rtin.tileSize *= 2;
+    }
+    compute_errors(&rtin);
+    collect_triangles(&rtin, meshOptions.max_error, 0, 0, rtin.tileSize, rtin.tileSize, rtin.tileSize, 0);
+    collect_triangles(&rtin, meshOptions.max_error, rtin.tileSize, rtin.tileSize, 0, 0, 0, rtin.tileSize);
+    std::vector<float>().swap(rtin.errors);
+
+    // number the grid vertices that the triangles use, in grid order
+    std::vector<uint32_t> vertex_index(radii.size(), UINT32_MAX);
+    for (std::array<int64_t, 3> &triangle : rtin.triangles) {
+        for (int64_t grid_idx : triangle) {
+            vertex_index[grid_idx] = 0;
+        }
+    }
+    CartesianTransform transform = DEMManager::scaleTransform(meshOptions.scale);
+    if (meshOptions.rotate_flat) {
+        transform = DEMManager::rotateFlatTransform(meshOptions.latlon[0], meshOptions.latlon[1], center_elevation, meshOptions.scale);
+    }
+    std::vector<std::array<float, 3>> vertices;
+    std::vector<std::array<float, 2>> uvs;
+    for (int64_t grid_idx = 0; grid_idx < (int64_t)radii.size(); grid_idx++) {
+        if (vertex_index[grid_idx] == UINT32_MAX) {
+            continue;
+        }
+        vertex_index[grid_idx] = vertices.size();
+        int lat_idx = grid_idx / vertices_width;
+        int lon_idx = grid_idx % vertices_width;
+        double lat = (double)meshOptions.min_latlon[0] + lat_idx / (double)meshOptions.verts_per_degree;
+        double lon = (double)meshOptions.min_latlon[1] + lon_idx / (double)meshOptions.verts_per_degree;
+        std::array<float, 3> vertex;
+        DEMManager::toCartesian(&vertex, radii[grid_idx], lat, lon, transform);
+        vertices.push_back(vertex);
+        uvs.push_back({(float)lon_idx / (vertices_width - 1), (float)lat_idx / (vertices_height - 1)});
+    }
+    std::vector<std::array<uint32_t, 3>> faces(rtin.triangles.size());
+    for (size_t face_idx = 0; face_idx < faces.size(); face_idx++) {
+        for (int corner = 0; corner < 3; corner++) {
+            faces[face_idx][corner] = vertex_index[rtin.triangles[face_idx][corner]];
+        }
+    }
+    std::cout << "Adaptive mesh has " << vertices.size() << " vertices and " << faces.size() << " triangles, down from "
+              << radii.size() << " vertices" << std::endl;
+    triangulateTimer.stop();
+
+    PhaseTimer writeTimer("write");
+
+    std::unique_ptr<MeshWriter> meshFile = open_mesh_writer(meshOptions.format, meshOptions.output + "." + meshOptions.format, pool);
+    if (!meshFile->isOpen()) {
+        return 1;
+    }
+    meshFile->begin(MeshLayout{vertices.size(), faces.size(), 3, 0, 0, meshOptions.output});
+    std::cout << "Writing vertices and uvs" << std::endl;
+    meshFile->writeVertices(vertices.data(), uvs.data(), vertices.size());
+    std::cout << "Writing faces" << std::endl;
+    meshFile->writeTriangles(faces.data(), faces.size());
+    int status = meshFile->close();
+    writeTimer.stop();
+    if (status) {
+        return status;
+    }
+
+    write_mtl(meshOptions);
+    std::cout << "Done" << std::endl;
+    return 0;
+}
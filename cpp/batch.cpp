@@ -0,0 +1,370 @@
+#include "batch.h"
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <cmath>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "cli.h"
+#include "moonsurface.h"
+#include "texture.h"
+
+struct JobContext {
+    std::vector<std::string> demPaths;
+    WorkPool *pool;
+    DEMManager *demManager;
+    // limits how many jobs build at once
+    std::mutex slotMutex;
+    std::condition_variable slotFreed;
+    int freeSlots;
+    std::mutex printMutex;
+};
+
+// splits a job line into arguments on whitespace. Double quotes group words, so paths can have spaces
+static std::vector<std::string> split_arguments(const std::string &line) {
+    std::vector<std::string> arguments;
+    std::string current;
+    bool quoted = false;
+    bool inArgument = false;
+    for (char c : line) {
+        if (c == '"') {
+            quoted = !quoted;
+            inArgument = true;
+        } else if (!quoted && isspace((unsigned char)c)) {
+            if (inArgument) {
+                arguments.push_back(current);
+                current.clear();
+                inArgument = false;
+            }
+        } else {
+            current += c;
+            inArgument = true;
+        }
+    }
+    if (inArgument) {
+        arguments.push_back(current);
+    }
+    return arguments;
+}
+
+// options that apply to the whole batch or server, or run something other than a mesh. They're set once on the
+// command line, so a job line that sets one is rejected rather than silently built with the process's values
+static const char *processOptions[] = {
+    "dem-path", "threads", "block-cache-mb", "stats-json", "batch", "batch-jobs", "listen",
+    "convert-dem", "convert-int16", "build-overviews", "sun-ephemeris", "sun-start", "sun-end", "sun-fps",
+};
+
+static bool is_job_line(const std::string &line) {
+    size_t first = line.find_first_not_of(" \t\r");
+    return first != std::string::npos && line[first] != '#';
+}
+
+// builds one job and describes how it went in outSummary. Returns 1 if it failed
+static int run_job(JobContext *context, const std::string &line, std::string *outSummary) {
+    std::vector<std::string> arguments = split_arguments(line);
+    arguments.insert(arguments.begin(), "MoonSurface");
+    std::vector<char *> argv;
+    for (std::string &argument : arguments) {
+        argv.push_back(&argument[0]);
+    }
+    argv.push_back(NULL);
+
+    MoonSurfaceOptions meshOptions;
+    try {
+        cxxopts::Options options = build_options();
+        char **args = argv.data();
+        int argc = arguments.size();
+        cxxopts::ParseResult result = options.parse(argc, args);
+        for (const char *option : processOptions) {
+            if (result.count(option)) {
+                *outSummary = std::string("--") + option + " can't be set per job in: " + line;
+                return 1;
+            }
+        }
+        if (read_mesh_options(options, result, &meshOptions)) {
+            *outSummary = "missing arguments in: " + line;
+            return 1;
+        }
+    } catch (const std::exception &error) {
+        *outSummary = std::string(error.what()) + " in: " + line;
+        return 1;
+    }
+    meshOptions.dem_paths = context->demPaths;
+
+    {
+        std::unique_lock<std::mutex> lock(context->slotMutex);
+        context->slotFreed.wait(lock, [context] { return context->freeSlots > 0; });
+        context->freeSlots--;
+    }
+    auto started = std::chrono::steady_clock::now();
+    int status = 0;
+    if (!meshOptions.texture_path.empty()) {
+        status = create_texture(meshOptions, context->pool);
+    }
+    if (status == 0) {
+        status = create_mesh(meshOptions, context->pool, context->demManager);
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    {
+        std::lock_guard<std::mutex> lock(context->slotMutex);
+        context->freeSlots++;
+    }
+    context->slotFreed.notify_one();
+
+    uint64_t vertices = (uint64_t)(floor(meshOptions.latlon_extent[0] * meshOptions.verts_per_degree) + 1) *
+                        (uint64_t)(floor(meshOptions.latlon_extent[1] * meshOptions.verts_per_degree) + 1);
+    std::ostringstream summary;
+    summary << meshOptions.output << ": " << vertices << " vertices in " << seconds << " s";
+    if (seconds > 0) {
+        summary << " (" << vertices / seconds << " vertices/s)";
+    }
+    *outSummary = summary.str();
+    return status;
+}
+
+struct BatchState {
+    JobContext *context;
+    std::vector<std::string> *lines;
+    std::atomic<size_t> nextLine;
+    std::atomic<int> failed;
+};
+
+static void *batch_thread(void *state) {
+    BatchState *batch = (BatchState *)state;
+    while (true) {
+        size_t line_idx = batch->nextLine++;
+        if (line_idx >= batch->lines->size()) {
+            return NULL;
+        }
+        std::string summary;
+        int status = run_job(batch->context, (*batch->lines)[line_idx], &summary);
+        if (status) {
+            batch->failed++;
+        }
+        std::lock_guard<std::mutex> lock(batch->context->printMutex);
+        std::cout << (status ? "Job failed: " : "Job done: ") << summary << std::endl;
+    }
+}
+
+int run_batch(std::string manifestPath, int concurrentJobs, std::vector<std::string> demPaths, WorkPool *pool, DEMManager *demManager) {
+    std::ifstream manifest(manifestPath);
+    if (!manifest.is_open()) {
+        std::cout << "Failed to open " << manifestPath << std::endl;
+        return 1;
+    }
+    std::vector<std::string> lines;
+    std::string line;
+    while (std::getline(manifest, line)) {
+        if (is_job_line(line)) {
+            lines.push_back(line);
+        }
+    }
+
+    JobContext context;
+    context.demPaths = demPaths;
+    context.pool = pool;
+    context.demManager = demManager;
+    context.freeSlots = std::max(1, concurrentJobs);
+    BatchState batch;
+    batch.context = &context;
+    batch.lines = &lines;
+    batch.nextLine = 0;
+    batch.failed = 0;
+
+    std::cout << "Running " << lines.size() << " jobs, " << context.freeSlots << " at a time" << std::endl;
+    auto started = std::chrono::steady_clock::now();
+    int thread_count = std::min<int>(context.freeSlots, lines.size());
+    std::vector<pthread_t> threads(thread_count);
+    for (pthread_t &thread : threads) {
+        pthread_create(&thread, NULL, batch_thread, &batch);
+    }
+    for (pthread_t &thread : threads) {
+        pthread_join(thread, NULL);
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    std::cout << "Batch finished " << lines.size() - batch.failed << " of " << lines.size() << " jobs in " << seconds << " s" << std::endl;
+    return batch.failed > 0;
+}
+
+struct ServerState {
+    JobContext *context;
+    int listenSocket;
+    // writing a byte to the pipe wakes the accept loop. Shutting down a listening socket only wakes accept on Linux
+    int wakePipe[2];
+    std::atomic<bool> stopping;
+    std::mutex connectionMutex;
+    std::condition_variable connectionClosed;
+    std::set<int> connections;
+};
+
+struct ConnectionState {
+    ServerState *server;
+    int socket;
+};
+
+static void send_line(int socket, const std::string &line) {
+    std::string message = line + "\n";
+    size_t sent = 0;
+    while (sent < message.size()) {
+        ssize_t written = send(socket, message.data() + sent, message.size() - sent, MSG_NOSIGNAL);
+        if (written <= 0) {
+            return;
+        }
+        sent += written;
+    }
+}
+
+// reads job lines from one client until it disconnects, running each as it arrives
+static void *connection_thread(void *state) {
+    ConnectionState *connection = (ConnectionState *)state;
+    ServerState *server = connection->server;
+    std::string pending;
+    char buffer[4096];
+    bool open = true;
+    while (open) {
+        ssize_t received = recv(connection->socket, buffer, sizeof(buffer), 0);
+        if (received <= 0) {
+            break;
+        }
+        pending.append(buffer, received);
+        size_t newline;
+        while ((newline = pending.find('\n')) != std::string::npos) {
+            std::string line = pending.substr(0, newline);
+            pending.erase(0, newline + 1);
+            if (!line.empty() && line.back() == '\r') {
+                line.pop_back();
+            }
+            if (line == "shutdown") {
+                server->stopping = true;
+                // wakes the accept loop so it can see that the server is stopping,
+                // and lets the other clients finish the job they're on without reading any more
+                if (write(server->wakePipe[1], "x", 1) != 1) {
+                    std::cout << "Failed to wake the job server: " << strerror(errno) << std::endl;
+                }
+                {
+                    std::lock_guard<std::mutex> lock(server->connectionMutex);
+                    for (int socket : server->connections) {
+                        if (socket != connection->socket) {
+                            shutdown(socket, SHUT_RD);
+                        }
+                    }
+                }
+                send_line(connection->socket, "ok shutting down");
+                open = false;
+                break;
+            }
+            if (!is_job_line(line)) {
+                continue;
+            }
+            std::string summary;
+            int status = run_job(server->context, line, &summary);
+            send_line(connection->socket, (status ? "error " : "ok ") + summary);
+            std::lock_guard<std::mutex> lock(server->context->printMutex);
+            std::cout << (status ? "Job failed: " : "Job done: ") << summary << std::endl;
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(server->connectionMutex);
+        server->connections.erase(connection->socket);
+        close(connection->socket);
+        // notify while holding the lock, since the server's state is gone as soon as it sees the last connection close
+        server->connectionClosed.notify_all();
+    }
+    delete connection;
+    return NULL;
+}
+
+int run_job_server(std::string socketPath, int concurrentJobs, std::vector<std::string> demPaths, WorkPool *pool, DEMManager *demManager) {
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (socketPath.size() >= sizeof(address.sun_path)) {
+        std::cout << "Socket path is too long: " << socketPath << std::endl;
+        return 1;
+    }
+    strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+    int listenSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socketPath.c_str());
+    if (listenSocket < 0 || bind(listenSocket, (sockaddr *)&address, sizeof(address)) != 0 || listen(listenSocket, 16) != 0) {
+        std::cout << "Failed to listen on " << socketPath << ": " << strerror(errno) << std::endl;
+        if (listenSocket >= 0) {
+            close(listenSocket);
+        }
+        return 1;
+    }
+
+    JobContext context;
+    context.demPaths = demPaths;
+    context.pool = pool;
+    context.demManager = demManager;
+    context.freeSlots = std::max(1, concurrentJobs);
+    ServerState server;
+    server.context = &context;
+    server.listenSocket = listenSocket;
+    server.stopping = false;
+    if (pipe(server.wakePipe) != 0) {
+        std::cout << "Failed to create a pipe: " << strerror(errno) << std::endl;
+        close(listenSocket);
+        unlink(socketPath.c_str());
+        return 1;
+    }
+
+    std::cout << "Listening for jobs on " << socketPath << std::endl;
+    while (!server.stopping) {
+        pollfd waiting[2] = {{listenSocket, POLLIN, 0}, {server.wakePipe[0], POLLIN, 0}};
+        if (poll(waiting, 2, -1) < 0) {
+            if (errno != EINTR) {
+                break;
+            }
+            continue;
+        }
+        if (server.stopping || waiting[1].revents) {
+            break;
+        }
+        if (!waiting[0].revents) {
+            continue;
+        }
+        int clientSocket = accept(listenSocket, NULL, NULL);
+        if (clientSocket < 0) {
+            if (server.stopping || errno != EINTR) {
+                break;
+            }
+            continue;
+        }
+        ConnectionState *connection = new ConnectionState{&server, clientSocket};
+        {
+            std::lock_guard<std::mutex> lock(server.connectionMutex);
+            server.connections.insert(clientSocket);
+            if (server.stopping) {
+                shutdown(clientSocket, SHUT_RD);
+            }
+        }
+        pthread_t thread;
+        pthread_create(&thread, NULL, connection_thread, connection);
+        pthread_detach(thread);
+    }
+
+    // let the clients that are still connected finish their jobs
+    {
+        std::unique_lock<std::mutex> lock(server.connectionMutex);
+        server.connectionClosed.wait(lock, [&server] { return server.connections.empty(); });
+    }
+    close(listenSocket);
+    close(server.wakePipe[0]);
+    close(server.wakePipe[1]);
+    unlink(socketPath.c_str());
+    std::cout << "Stopped listening on " << socketPath << std::endl;
+    return 0;
+}
@@ -0,0 +1,15 @@
+#pragma once
+#include <string>
+#include <vector>
+#include "dem.h"
+#include "workpool.h"
+
+// runs every job in a manifest file, where each non-empty line that doesn't start with # holds the mesh arguments
+// of one job, e.g. --centerlat 10 --centerlon 20 --latextent 1 --lonextent 1 --verts-per-degree 512 --output crater.
+// up to concurrentJobs jobs are built at once, all sampling through demManager and sharing the pool.
+// jobs that set --dem-path, --threads or another option of the whole process fail.
+// returns 1 if any job failed
+int run_batch(std::string manifestPath, int concurrentJobs, std::vector<std::string> demPaths, WorkPool *pool, DEMManager *demManager);
+// listens on a Unix socket and runs each line a client sends as a job, replying with one line per job that starts
+// with ok or error. A client sending shutdown stops the server once the running jobs finish
+int run_job_server(std::string socketPath, int concurrentJobs, std::vector<std::string> demPaths, WorkPool *pool, DEMManager *demManager);
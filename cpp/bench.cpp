@@ -0,0 +1,359 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <unistd.h>
+#include <cxxopts.hpp>
+#include "gdal_priv.h"
+#include "cpl_conv.h"
+#include "cpl_vsi.h"
+#include "ogr_spatialref.h"
+#include "moonsurface.h"
+#include "dem.h"
+#include "meshwriter.h"
+#include "workpool.h"
+
+// benchmarks the sampling, mesh generation and writing paths against synthetic DEMs, so no real data has to be downloaded.
+// every result is printed as one JSON object per line so runs can be compared between releases
+
+static const double moonRadius = 1737400.0;
+static const char *benchDirectory = "/vsimem/moonsurface_bench/";
+
+struct SyntheticDEM {
+    std::string name;
+    std::string path;
+    // where random sample points are drawn from
+    float min_lat;
+    float max_lat;
+    float min_lon;
+    float max_lon;
+};
+
+// a smooth height field with some higher frequency bumps, so interpolation does real work
+static float synthetic_height(double lat, double lon) {
+    return 2000.0 * sin(lat * 0.11) * cos(lon * 0.07) + 150.0 * sin(lat * 3.1 + lon * 2.3);
+}
+
+// writes a DEM in the given projection to GDAL's in memory file system, with heights from synthetic_height.
+// holes of nodata are cut out when holes is set. Tiled DEMs use 256x256 blocks, the others are stored in strips of rows
+static std::string write_dem(std::string name, std::string proj4, const double geoTransform[6], int width, int height, bool tiled, bool holes) {
+    std::string path = std::string(benchDirectory) + name + ".tif";
+    char **creationOptions = NULL;
+    if (tiled) {
+        creationOptions = CSLSetNameValue(creationOptions, "TILED", "YES");
+        creationOptions = CSLSetNameValue(creationOptions, "BLOCKXSIZE", "256");
+        creationOptions = CSLSetNameValue(creationOptions, "BLOCKYSIZE", "256");
+    }
+    GDALDriver *driver = GetGDALDriverManager()->GetDriverByName("GTiff");
+    GDALDataset *dataset = driver->Create(path.c_str(), width, height, 1, GDT_Float32, creationOptions);
+    CSLDestroy(creationOptions);
+
+    OGRSpatialReference ref;
+    ref.importFromProj4(proj4.c_str());
+    OGRSpatialReference latLonRef;
+    latLonRef.CopyGeogCSFrom(&ref);
+    latLonRef.SetAxisMappingStrategy(OAMS_TRADITIONAL_GIS_ORDER);
+    ref.SetAxisMappingStrategy(OAMS_TRADITIONAL_GIS_ORDER);
+    OGRCoordinateTransformation *toLatLon = OGRCreateCoordinateTransformation(&ref, &latLonRef);
+    dataset->SetSpatialRef(&ref);
+    dataset->SetGeoTransform(const_cast<double *>(geoTransform));
+    const float noDataValue = -32768.0f;
+    dataset->GetRasterBand(1)->SetNoDataValue(noDataValue);
+
+    std::vector<double> x(width);
+    std::vector<double> y(width);
+    std::vector<float> row(width);
+    for (int row_idx = 0; row_idx < height; row_idx++) {
+        for (int column = 0; column < width; column++) {
+            x[column] = geoTransform[0] + geoTransform[1] * (column + 0.5);
+            y[column] = geoTransform[3] + geoTransform[5] * (row_idx + 0.5);
+        }
+        (void)toLatLon->Transform(width, x.data(), y.data());
+        for (int column = 0; column < width; column++) {
+            row[column] = synthetic_height(y[column], x[column]);
+            // a 32 pixel hole every 128 pixels each way leaves the coarser DEMs to fill them in
+            if (holes && (row_idx / 32) % 4 == 1 && (column / 32) % 4 == 1) {
+                row[column] = noDataValue;
+            }
+        }
+        (void)dataset->GetRasterBand(1)->RasterIO(GF_Write, 0, row_idx, width, 1, row.data(), width, 1, GDT_Float32, 0, 0);
+    }
+    OGRCoordinateTransformation::DestroyCT(toLatLon);
+    GDALClose(dataset);
+    return path;
+}
+
+static SyntheticDEM global_dem(std::string name, bool tiled) {
+    // 0.125 degree simple cylindrical DEM of the whole Moon
+    int width = 2880;
+    int height = 1440;
+    double metres_per_degree = moonRadius * M_PI / 180.0;
+    double geoTransform[6] = {-180 * metres_per_degree, 360 * metres_per_degree / width, 0,
+                              90 * metres_per_degree, 0, -180 * metres_per_degree / height};
+    SyntheticDEM dem;
+    dem.name = name;
+    dem.path = write_dem(name, "+proj=eqc +R=1737400 +units=m +no_defs", geoTransform, width, height, tiled, false);
+    dem.min_lat = -89;
+    dem.max_lat = 89;
+    dem.min_lon = -180;
+    dem.max_lon = 180;
+    return dem;
+}
+
+static SyntheticDEM polar_dem() {
+    // 500 m per pixel south polar stereographic DEM reaching about 15 degrees from the pole
+    int size = 1800;
+    double half_width = size * 500.0 / 2.0;
+    double geoTransform[6] = {-half_width, 500.0, 0, half_width, 0, -500.0};
+    SyntheticDEM dem;
+    dem.name = "polar_stereographic";
+    dem.path = write_dem(dem.name, "+proj=stere +lat_0=-90 +lon_0=0 +k=1 +R=1737400 +units=m +no_defs", geoTransform, size, size, true, true);
+    dem.min_lat = -89.5;
+    dem.max_lat = -80;
+    dem.min_lon = -180;
+    dem.max_lon = 180;
+    return dem;
+}
+
+// a 4 degree square patch at 1/128 degree, offset a little from the others so the patches overlap without lining up
+static SyntheticDEM regional_dem(int index) {
+    int size = 512;
+    double metres_per_degree = moonRadius * M_PI / 180.0;
+    double offset = (index % 7) * 0.1 - 0.3;
+    double pixel = metres_per_degree / 128.0;
+    double geoTransform[6] = {(-2 + offset) * metres_per_degree, pixel, 0, (2 - offset) * metres_per_degree, 0, -pixel};
+    SyntheticDEM dem;
+    dem.name = "regional_" + std::to_string(index);
+    dem.path = write_dem(dem.name, "+proj=eqc +R=1737400 +units=m +no_defs", geoTransform, size, size, index % 2 == 0, true);
+    dem.min_lat = -1.5;
+    dem.max_lat = 1.5;
+    dem.min_lon = -1.5;
+    dem.max_lon = 1.5;
+    return dem;
+}
+
+struct BenchResult {
+    double seconds;
+    uint64_t items;
+    uint64_t bytes;
+};
+
+class BenchRunner {
+    // runs each benchmark a few times and reports the fastest run.
+    // the program's own progress messages are hidden while a benchmark runs, so only results reach stdout
+    private:
+        std::ostream results;
+        std::string filter;
+        int repetitions;
+        std::stringstream discarded;
+    public:
+        BenchRunner(std::string filter, int repetitions) : results(std::cout.rdbuf()), filter(filter), repetitions(repetitions) {}
+        void run(std::string name, int threads, std::function<BenchResult()> benchmark) {
+            if (name.find(this->filter) == std::string::npos) {
+                return;
+            }
+            std::streambuf *original = std::cout.rdbuf(this->discarded.rdbuf());
+            BenchResult best = {INFINITY, 0, 0};
+            for (int repetition = 0; repetition < this->repetitions; repetition++) {
+                BenchResult result = benchmark();
+                if (result.seconds < best.seconds) {
+                    best = result;
+                }
+                this->discarded.str("");
+            }
+            std::cout.rdbuf(original);
+            this->results << "{\"benchmark\": \"" << name << "\", \"threads\": " << threads
+                          << ", \"repetitions\": " << this->repetitions << ", \"seconds\": " << best.seconds
+                          << ", \"items\": " << best.items << ", \"items_per_second\": " << best.items / best.seconds;
+            if (best.bytes > 0) {
+                this->results << ", \"bytes\": " << best.bytes << ", \"mb_per_second\": " << best.bytes / best.seconds / 1e6;
+            }
+            this->results << "}" << std::endl;
+        }
+};
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static std::vector<std::array<float, 2>> random_points(const SyntheticDEM &dem, int count) {
+    std::mt19937 generator(1234);
+    std::uniform_real_distribution<float> lat(dem.min_lat, dem.max_lat);
+    std::uniform_real_distribution<float> lon(dem.min_lon, dem.max_lon);
+    std::vector<std::array<float, 2>> points(count);
+    for (std::array<float, 2> &point : points) {
+        point = {lat(generator), lon(generator)};
+    }
+    return points;
+}
+
+int main(int argc, char *argv[]) {
+    GDALAllRegister();
+
+    cxxopts::Options options("MoonSurfaceBench", "Benchmarks MoonSurface against synthetic DEMs");
+    options.add_options()
+        ("filter", "Only run benchmarks whose name contains this", cxxopts::value<std::string>()->default_value(""))
+        ("repetitions", "Runs of each benchmark, the fastest is reported", cxxopts::value<int>()->default_value("3"))
+        ("samples", "Points sampled by each sampling benchmark", cxxopts::value<int>()->default_value("200000"))
+        ("verts-per-degree", "Vertex density of the mesh benchmarks", cxxopts::value<double>()->default_value("256"))
+        ("h,help", "Print help")
+    ;
+    cxxopts::ParseResult result = options.parse(argc, argv);
+    if (result.count("help")) {
+        std::cout << options.help() << std::endl;
+        return 0;
+    }
+    std::string filter = result["filter"].as<std::string>();
+    int sample_count = result["samples"].as<int>();
+    double verts_per_degree = result["verts-per-degree"].as<double>();
+    BenchRunner runner(filter, result["repetitions"].as<int>());
+
+    std::vector<SyntheticDEM> singles = {global_dem("global_tiled", true), global_dem("global_striped", false), polar_dem()};
+    std::vector<SyntheticDEM> regionals;
+    for (int index = 0; index < 50; index++) {
+        regionals.push_back(regional_dem(index));
+    }
+
+    for (const SyntheticDEM &dem : singles) {
+        std::vector<std::array<float, 2>> points = random_points(dem, sample_count);
+        runner.run("single_dem_sample/" + dem.name, 1, [&dem, &points]() {
+            SingleDEM singleDEM(dem.path);
+            auto start = std::chrono::steady_clock::now();
+            float value;
+            for (const std::array<float, 2> &point : points) {
+                (void)singleDEM.sample(&value, point[0], point[1]);
+            }
+            BenchResult bench = {seconds_since(start), points.size(), 0};
+            singleDEM.close();
+            return bench;
+        });
+    }
+
+    // the finest DEMs overlap around (0, 0), with the global DEM underneath to fill their holes
+    std::vector<std::array<float, 2>> regional_points = random_points(regionals[0], sample_count);
+    // dem_count counts the global DEM too, so the label is the number of DEMs the manager opens
+    for (int dem_count : {1, 10, 50}) {
+        std::vector<std::string> paths = {singles[0].path};
+        for (int index = 0; index < dem_count - 1; index++) {
+            paths.push_back(regionals[index].path);
+        }
+        runner.run("dem_manager_sample/dems=" + std::to_string(dem_count), 1, [&paths, &regional_points]() {
+            DEMManager demManager(paths);
+            auto start = std::chrono::steady_clock::now();
+            for (const std::array<float, 2> &point : regional_points) {
+                (void)demManager.sample(point[0], point[1]);
+            }
+            BenchResult bench = {seconds_since(start), regional_points.size(), 0};
+            demManager.close();
+            return bench;
+        });
+    }
+
+    for (bool rotate_flat : {false, true}) {
+        std::vector<std::string> paths = {singles[0].path, regionals[0].path};
+        runner.run(std::string("get_cartesian/rotate_flat=") + (rotate_flat ? "1" : "0"), 1, [&paths, &regional_points, rotate_flat]() {
+            DEMManager demManager(paths);
+            std::array<float, 3> vertex;
+            auto start = std::chrono::steady_clock::now();
+            for (const std::array<float, 2> &point : regional_points) {
+                if (rotate_flat) {
+                    demManager.getCartesian(&vertex, point[0], point[1], 0.0f, 0.0f, moonRadius, 0.001f);
+                } else {
+                    demManager.getCartesian(&vertex, point[0], point[1], 0.001f);
+                }
+            }
+            BenchResult bench = {seconds_since(start), regional_points.size(), 0};
+            demManager.close();
+            return bench;
+        });
+    }
+
+    std::filesystem::path outputDirectory = std::filesystem::temp_directory_path() / ("moonsurface_bench_" + std::to_string(getpid()));
+    std::filesystem::create_directories(outputDirectory);
+
+    MoonSurfaceOptions meshOptions;
+    meshOptions.latlon[0] = 0;
+    meshOptions.latlon[1] = 0;
+    meshOptions.latlon_extent[0] = 3;
+    meshOptions.latlon_extent[1] = 3;
+    meshOptions.min_latlon[0] = -1.5;
+    meshOptions.min_latlon[1] = -1.5;
+    meshOptions.verts_per_degree = verts_per_degree;
+    meshOptions.scale = 0.001;
+    meshOptions.max_error = 0;
+    meshOptions.band_rows = 0;
+    meshOptions.pyramid_levels = 0;
+    meshOptions.rotate_flat = true;
+    meshOptions.dem_paths = {singles[0].path};
+    for (int index = 0; index < 10; index++) {
+        meshOptions.dem_paths.push_back(regionals[index].path);
+    }
+    meshOptions.output = (outputDirectory / "mesh").string();
+    meshOptions.format = "obj";
+    uint64_t vertex_count = (uint64_t)(floor(3 * verts_per_degree) + 1) * (uint64_t)(floor(3 * verts_per_degree) + 1);
+
+    std::vector<int> thread_counts = {1, 2, 4, 8};
+    int hardware_threads = WorkPool::resolveThreadCount(0);
+    if (std::find(thread_counts.begin(), thread_counts.end(), hardware_threads) == thread_counts.end()) {
+        thread_counts.push_back(hardware_threads);
+    }
+    for (int threads : thread_counts) {
+        if (threads > hardware_threads) {
+            continue;
+        }
+        runner.run("create_mesh", threads, [&meshOptions, &outputDirectory, threads, vertex_count]() {
+            WorkPool pool(threads);
+            auto start = std::chrono::steady_clock::now();
+            (void)create_mesh(meshOptions, &pool);
+            double seconds = seconds_since(start);
+            BenchResult bench = {seconds, vertex_count, std::filesystem::file_size(outputDirectory / "mesh.obj")};
+            return bench;
+        });
+    }
+
+    // the writers alone, formatting a synthetic grid
+    int grid_size = floor(3 * verts_per_degree) + 1;
+    uint64_t grid_vertices = (uint64_t)grid_size * grid_size;
+    std::vector<float> grid_x(grid_vertices);
+    std::vector<float> grid_y(grid_vertices);
+    std::vector<float> grid_z(grid_vertices);
+    for (size_t index = 0; index < grid_vertices; index++) {
+        grid_x[index] = (float)(index % grid_size) * 0.37f;
+        grid_y[index] = (float)(index / grid_size) * 0.37f;
+        grid_z[index] = synthetic_height(index * 0.01, index * 0.02) * 0.001f;
+    }
+    MeshLayout gridLayout = {grid_vertices, (uint64_t)(grid_size - 1) * (grid_size - 1), 4, grid_size, grid_size, ""};
+    for (std::string format : {"obj", "ply"}) {
+        std::string writerPath = (outputDirectory / ("writer." + format)).string();
+        for (int threads : thread_counts) {
+            if (threads > hardware_threads) {
+                continue;
+            }
+            runner.run(format + "_writer", threads, [&, format, writerPath, threads]() {
+                WorkPool pool(threads);
+                auto start = std::chrono::steady_clock::now();
+                std::unique_ptr<MeshWriter> writer = open_mesh_writer(format, writerPath, &pool);
+                writer->begin(gridLayout);
+                writer->writeVertices(grid_x.data(), grid_y.data(), grid_z.data(), grid_vertices);
+                writer->writeGridFaces(grid_size, grid_size);
+                writer->close(false);
+                uint64_t bytes = writer->totalBytes();
+                BenchResult bench = {seconds_since(start), grid_vertices, bytes};
+                return bench;
+            });
+        }
+    }
+
+    std::filesystem::remove_all(outputDirectory);
+    for (const SyntheticDEM &dem : singles) {
+        VSIUnlink(dem.path.c_str());
+    }
+    for (const SyntheticDEM &dem : regionals) {
+        VSIUnlink(dem.path.c_str());
+    }
+    return 0;
+}
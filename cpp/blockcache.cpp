@@ -0,0 +1,92 @@
+#include "blockcache.h"
+#include <mutex>
+#include <set>
+
+size_t BlockCache::defaultCapacityBytes = 64 * 1024 * 1024;
+
+// caches of threads that are still running, and the stats of those whose threads have already exited
+static std::mutex registryMutex;
+static std::set<const BlockCache *> liveCaches;
+static BlockCacheStats retired = {0, 0, 0};
+
+BlockCache &BlockCache::local() {
+    static thread_local BlockCache cache(BlockCache::defaultCapacityBytes);
+    return cache;
+}
+
+BlockCacheStats BlockCache::totals() {
+    std::lock_guard<std::mutex> lock(registryMutex);
+    BlockCacheStats total = retired;
+    for (const BlockCache *cache : liveCaches) {
+        total.hits += cache->stats.hits;
+        total.misses += cache->stats.misses;
+        total.evictions += cache->stats.evictions;
+    }
+    return total;
+}
+
+// 24 bits of source id, 20 bits for each block coordinate
+uint64_t BlockCache::makeKey(int source, int block_x, int block_y) {
+    return ((uint64_t)(source & 0xFFFFFF) << 40) | ((uint64_t)(block_x & 0xFFFFF) << 20) | (uint64_t)(block_y & 0xFFFFF);
+}
+
+BlockCache::BlockCache(size_t capacityBytes) {
+    this->capacityBytes = capacityBytes;
+    this->usedBytes = 0;
+    this->stats.hits = 0;
+    this->stats.misses = 0;
+    this->stats.evictions = 0;
+    std::lock_guard<std::mutex> lock(registryMutex);
+    liveCaches.insert(this);
+}
+
+BlockCache::~BlockCache() {
+    std::lock_guard<std::mutex> lock(registryMutex);
+    liveCaches.erase(this);
+    retired.hits += this->stats.hits;
+    retired.misses += this->stats.misses;
+    retired.evictions += this->stats.evictions;
+}
+
+// returns the cached block and marks it as most recently used, or NULL if the block isn't cached
+const float *BlockCache::find(uint64_t key) {
+    auto it = this->entries.find(key);
+    if (it == this->entries.end()) {
+        this->stats.misses++;
+        return NULL;
+    }
+    this->stats.hits++;
+    if (it->second != this->lru.begin()) {
+        this->lru.splice(this->lru.begin(), this->lru, it->second);
+    }
+    return it->second->data.data();
+}
+
+// makes room for a block of count floats and returns the buffer for the caller to fill.
+// the buffer stays valid until the next insert, which may evict it
+float *BlockCache::insert(uint64_t key, size_t count) {
+    size_t bytes = count * sizeof(float);
+    // always keep at least the block being inserted, even if it is bigger than the whole cache
+    while (!this->lru.empty() && this->usedBytes + bytes > this->capacityBytes) {
+        Entry &oldest = this->lru.back();
+        this->usedBytes -= oldest.data.size() * sizeof(float);
+        this->entries.erase(oldest.key);
+        this->lru.pop_back();
+        this->stats.evictions++;
+    }
+    this->lru.push_front(Entry{key, std::vector<float>(count)});
+    this->entries[key] = this->lru.begin();
+    this->usedBytes += bytes;
+    return this->lru.front().data.data();
+}
+
+// drops a block, e.g. one whose read failed after it was inserted
+void BlockCache::erase(uint64_t key) {
+    auto it = this->entries.find(key);
+    if (it == this->entries.end()) {
+        return;
+    }
+    this->usedBytes -= it->second->data.size() * sizeof(float);
+    this->lru.erase(it->second);
+    this->entries.erase(it);
+}
@@ -0,0 +1,40 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <unordered_map>
+#include <vector>
+
+struct BlockCacheStats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+};
+
+class BlockCache {
+    // a per-thread LRU cache of decoded DEM blocks, keyed on the source and the block's position
+    // lookups never take a lock because every thread owns its own cache
+    private:
+        struct Entry {
+            uint64_t key;
+            std::vector<float> data;
+        };
+        std::list<Entry> lru;
+        std::unordered_map<uint64_t, std::list<Entry>::iterator> entries;
+        size_t capacityBytes;
+        size_t usedBytes;
+        BlockCacheStats stats;
+    public:
+        // capacity of each thread's cache, set before any worker threads start
+        static size_t defaultCapacityBytes;
+        static BlockCache &local();
+        // hits and misses over every thread that has used a cache so far.
+        // only call this while no other thread is sampling
+        static BlockCacheStats totals();
+        static uint64_t makeKey(int source, int block_x, int block_y);
+        BlockCache(size_t capacityBytes);
+        ~BlockCache();
+        const float *find(uint64_t key);
+        float *insert(uint64_t key, size_t count);
+        void erase(uint64_t key);
+};
@@ -0,0 +1,104 @@
+#include "cli.h"
+#include <iostream>
+#include <cmath>
+
+int argument_exists(std::string flag, cxxopts::Options options, cxxopts::ParseResult result) {
+    if (result.count(flag) == 0) {
+        std::cout << "Missing argument: " << flag << std::endl;
+        std::cout << options.help() << std::endl;
+        return 0;
+    }
+    return 1;
+}
+
+cxxopts::Options build_options() {
+    cxxopts::Options options("MoonSurface", "A program to generate a moon surface");
+    options.add_options()
+        ("centerlat", "Center Latitude", cxxopts::value<double>())
+        ("centerlon", "Center Longitude", cxxopts::value<double>())
+        ("latextent", "Latitude Width", cxxopts::value<double>())
+        ("lonextent", "Longitude Height", cxxopts::value<double>())
+        ("verts-per-degree", "Vertices Per Degree", cxxopts::value<double>())
+        ("scale", "Scale", cxxopts::value<double>()->default_value("1.0"))
+        ("max-error", "Build an adaptive triangle mesh that is within this many metres of the full grid. 0 builds the full grid", cxxopts::value<double>()->default_value("0"))
+        ("pyramid-levels", "Write a quadtree of mesh tiles with this many levels, each halving the vertex spacing, plus an index file. 0 writes a single mesh", cxxopts::value<int>()->default_value("0"))
+        ("threads", "Number of threads, 0 uses every hardware thread", cxxopts::value<int>()->default_value("1"))
+        ("band-rows", "Generate and write the mesh in bands of this many rows instead of holding all of it in memory. 0 disables streaming", cxxopts::value<int>()->default_value("0"))
+        ("block-cache-mb", "Size of each thread's DEM block cache in megabytes", cxxopts::value<int>()->default_value("64"))
+        ("rotate-flat", "Transform mesh so the center latlon is facing z-up", cxxopts::value<bool>()->default_value("false"))
+        ("dem-path", "Path to DEM file. Can be used multiple times to load multiple DEM files.", cxxopts::value<std::vector<std::string>>())
+        ("img-path", "Path to image file.", cxxopts::value<std::string>())
+        ("texture-compress", "Compression for the cropped texture, e.g. DEFLATE, LZW or NONE", cxxopts::value<std::string>()->default_value("NONE"))
+        ("convert-dem", "Convert every --dem-path into a preprocessed .msdem file next to it, which loads and samples without GDAL, then exit", cxxopts::value<bool>()->default_value("false"))
+        ("build-overviews", "Build averaged overviews of every --dem-path into an .ovr file next to it, then exit. Coarse meshes are sampled from the overview closest to their vertex spacing", cxxopts::value<bool>()->default_value("false"))
+        ("convert-int16", "Store converted DEMs as scaled 16 bit integers instead of 32 bit floats, halving their size", cxxopts::value<bool>()->default_value("false"))
+        ("sun-ephemeris", "Write the direction of the Sun for every frame from --sun-start to --sun-end to <output>_sun.csv using this JPL .bsp ephemeris, then exit", cxxopts::value<std::string>())
+        ("sun-start", "UTC time of the first sun frame, YYYY-MM-DD HH:MM:SS", cxxopts::value<std::string>())
+        ("sun-end", "UTC time of the last sun frame, defaults to --sun-start", cxxopts::value<std::string>())
+        ("sun-fps", "Sun frames per second", cxxopts::value<double>()->default_value("24"))
+        ("sample-cache", "Keep sampled heights in this directory and reuse them in later runs over overlapping regions. Moves the mesh's corner onto the nearest vertex of a global lattice so runs line up", cxxopts::value<std::string>())
+        ("stats-json", "Write phase timings, sampling counters, peak memory and bytes written to this JSON file", cxxopts::value<std::string>())
+        ("batch", "Build every job in this manifest, one line of mesh arguments per job, sharing the opened DEMs and threads", cxxopts::value<std::string>())
+        ("batch-jobs", "Number of batch or socket jobs to build at once", cxxopts::value<int>()->default_value("2"))
+        ("listen", "Take jobs over a Unix socket at this path, one line of mesh arguments per job, until a client sends shutdown", cxxopts::value<std::string>())
+        ("format", "Mesh file format: obj, or ply for binary little endian PLY that loads without parsing", cxxopts::value<std::string>()->default_value("obj"))
+        ("output", "Output file title", cxxopts::value<std::string>()->default_value("moonmesh"))
+        ("h,help", "Print help")
+        ;
+    return options;
+}
+
+// fills in the options that describe one mesh. Returns 1 if a required one is missing
+int read_mesh_options(cxxopts::Options &options, cxxopts::ParseResult &result, MoonSurfaceOptions *meshOptions) {
+    if (!argument_exists("centerlat", options, result)) return 1;
+    meshOptions->latlon[0] = result["centerlat"].as<double>();
+
+    if (!argument_exists("centerlon", options, result)) return 1;
+    meshOptions->latlon[1] = result["centerlon"].as<double>();
+
+    if (!argument_exists("latextent", options, result)) return 1;
+    meshOptions->latlon_extent[0] = result["latextent"].as<double>();
+
+    if (!argument_exists("lonextent", options, result)) return 1;
+    meshOptions->latlon_extent[1] = result["lonextent"].as<double>();
+
+    meshOptions->min_latlon[0] = meshOptions->latlon[0] - meshOptions->latlon_extent[0] / 2.0;
+    meshOptions->min_latlon[1] = meshOptions->latlon[1] - meshOptions->latlon_extent[1] / 2.0;
+    if (!argument_exists("verts-per-degree", options, result)) return 1;
+    meshOptions->verts_per_degree = result["verts-per-degree"].as<double>();
+
+    meshOptions->scale = result["scale"].as<double>();
+    meshOptions->max_error = result["max-error"].as<double>();
+    meshOptions->band_rows = result["band-rows"].as<int>();
+    meshOptions->pyramid_levels = result["pyramid-levels"].as<int>();
+    meshOptions->rotate_flat = result["rotate-flat"].as<bool>();
+
+    meshOptions->threads = result["threads"].as<int>();
+    meshOptions->output = result["output"].as<std::string>();
+    meshOptions->format = result["format"].as<std::string>();
+    if (meshOptions->format != "obj" && meshOptions->format != "ply") {
+        std::cout << "Unknown mesh format: " << meshOptions->format << std::endl;
+        return 1;
+    }
+    // grids are the largest meshes of a region, adaptive meshes only use some of their vertices, and pyramid tiles
+    // have the same grid plus a skirt around it
+    uint64_t vertices_height = floor(meshOptions->latlon_extent[0] * meshOptions->verts_per_degree) + 1;
+    uint64_t vertices_width = floor(meshOptions->latlon_extent[1] * meshOptions->verts_per_degree) + 1;
+    uint64_t largest_mesh = vertices_width * vertices_height + 2 * (vertices_width + vertices_height);
+    if (meshOptions->format == "ply" && largest_mesh > plyMaxVertices) {
+        std::cout << "PLY meshes are limited to " << plyMaxVertices << " vertices, but this one could have " << largest_mesh
+                  << ". Use --format obj or fewer vertices per degree" << std::endl;
+        return 1;
+    }
+    meshOptions->texture_compression = result["texture-compress"].as<std::string>();
+    if (result.count("sample-cache")) {
+        meshOptions->sample_cache = result["sample-cache"].as<std::string>();
+        // snapped here as well as when the mesh is built, so the cropped texture lines up with the mesh
+        int64_t origin[2];
+        snap_to_sample_lattice(meshOptions, origin);
+    }
+    if (result.count("img-path")) {
+        meshOptions->texture_path = result["img-path"].as<std::string>();
+    }
+    return 0;
+}
@@ -0,0 +1,10 @@
+#pragma once
+#include <string>
+#include <cxxopts.hpp>
+#include "moonsurface.h"
+#include "meshwriter.h"
+
+// the command line, shared by main and the batch jobs, which take the same mesh arguments
+int argument_exists(std::string flag, cxxopts::Options options, cxxopts::ParseResult result);
+cxxopts::Options build_options();
+int read_mesh_options(cxxopts::Options &options, cxxopts::ParseResult &result, MoonSurfaceOptions *meshOptions);
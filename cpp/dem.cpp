@@ -1,13 +1,176 @@
 #include "dem.h"
+#include "blockcache.h"
+#include "stats.h"
+#include "demfile.h"
 #include <iostream>
 #include <cmath>
+#include <atomic>
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <numeric>
+// the AVX2 kernel is compiled on x86-64 unless the build turns it off, and only used if the CPU supports it
+#if (defined(__x86_64__) || defined(_M_X64)) && (defined(__GNUC__) || defined(__clang__)) && !defined(MOONSURFACE_NO_AVX2)
+#define MOONSURFACE_AVX2_KERNEL 1
+#include <immintrin.h>
+#else
+#define MOONSURFACE_AVX2_KERNEL 0
+#endif
+
+// every opened DEM gets its own id so its blocks can share the thread's cache with other DEMs
+static std::atomic<int> nextCacheId(0);
+
+// points whose covering window is bigger than this (e.g. lines of latitude in polar projections)
+// are sampled one by one through the block cache instead
+static const size_t maxWindowPixels = 16 * 1024 * 1024;
+
+// set when a block can't be read, so a whole grid can report that some of its samples are missing because of it
+static thread_local bool readFailed = false;
+
+// the spatial index in DEMManager is a grid of cells this many degrees on a side
+static const int indexCellsPerDegree = 1;
+static const int indexWidth = 360 * indexCellsPerDegree;
+static const int indexHeight = 180 * indexCellsPerDegree;
+
+// scratch space for sampling rows and grids, kept per thread so they don't allocate
+struct RowScratch {
+    std::vector<double> columns;
+    std::vector<double> rows;
+    std::vector<int> tl;
+    std::vector<int> tr;
+    std::vector<int> bl;
+    std::vector<int> br;
+    std::vector<float> x_frac;
+    std::vector<float> y_frac;
+    std::vector<float> window;
+};
+static thread_local RowScratch rowScratch;
+
+// maps a full resolution column or row onto an overview scale full resolution pixels to a pixel.
+// pixel values sit at whole coordinates, so an overview pixel sits at the middle of the pixels it averages
+static inline double levelCoordinate(double coordinate, double scale) {
+    return scale == 1 ? coordinate : (coordinate + 0.5) / scale - 0.5;
+}
+
+// bilinearly interpolates the points from first to count from the corner indices into window and adds offset.
+// valid must already hold which points are in bounds, points with a nodata corner are cleared
+static void bilinear_row_scalar(float *outVals, unsigned char *valid, const float *window, const RowScratch &scratch, int first, int count, float noDataValue, float offset) {
+    for (int i = first; i < count; i++) {
+        float val_tl = window[scratch.tl[i]];
+        float val_tr = window[scratch.tr[i]];
+        float val_bl = window[scratch.bl[i]];
+        float val_br = window[scratch.br[i]];
+        if (val_tl == noDataValue || val_tr == noDataValue || val_bl == noDataValue || val_br == noDataValue) {
+            valid[i] = 0;
+        }
+        float val_t = val_tl + (val_tr - val_tl) * scratch.x_frac[i];
+        float val_b = val_bl + (val_br - val_bl) * scratch.x_frac[i];
+        outVals[i] = val_t + (val_b - val_t) * scratch.y_frac[i] + offset;
+    }
+}
+
+#if MOONSURFACE_AVX2_KERNEL
+// the same interpolation eight points at a time with gathers. Only this function is compiled for AVX2,
+// so the rest of the program still runs on CPUs without it. Returns how many points it did
+__attribute__((target("avx2,fma")))
+static int bilinear_row_avx2(float *outVals, unsigned char *valid, const float *window, const RowScratch &scratch, int count, float noDataValue, float offset) {
+    int i = 0;
+    const __m256 nodata = _mm256_set1_ps(noDataValue);
+    const __m256 offsets = _mm256_set1_ps(offset);
+    for (; i + 8 <= count; i += 8) {
+        __m256 val_tl = _mm256_i32gather_ps(window, _mm256_loadu_si256((const __m256i *)(scratch.tl.data() + i)), sizeof(float));
+        __m256 val_tr = _mm256_i32gather_ps(window, _mm256_loadu_si256((const __m256i *)(scratch.tr.data() + i)), sizeof(float));
+        __m256 val_bl = _mm256_i32gather_ps(window, _mm256_loadu_si256((const __m256i *)(scratch.bl.data() + i)), sizeof(float));
+        __m256 val_br = _mm256_i32gather_ps(window, _mm256_loadu_si256((const __m256i *)(scratch.br.data() + i)), sizeof(float));
+        __m256 missing = _mm256_or_ps(
+            _mm256_or_ps(_mm256_cmp_ps(val_tl, nodata, _CMP_EQ_OQ), _mm256_cmp_ps(val_tr, nodata, _CMP_EQ_OQ)),
+            _mm256_or_ps(_mm256_cmp_ps(val_bl, nodata, _CMP_EQ_OQ), _mm256_cmp_ps(val_br, nodata, _CMP_EQ_OQ)));
+
+        __m256 x_frac = _mm256_loadu_ps(scratch.x_frac.data() + i);
+        __m256 y_frac = _mm256_loadu_ps(scratch.y_frac.data() + i);
+        __m256 val_t = _mm256_fmadd_ps(_mm256_sub_ps(val_tr, val_tl), x_frac, val_tl);
+        __m256 val_b = _mm256_fmadd_ps(_mm256_sub_ps(val_br, val_bl), x_frac, val_bl);
+        __m256 val_interp = _mm256_fmadd_ps(_mm256_sub_ps(val_b, val_t), y_frac, val_t);
+        _mm256_storeu_ps(outVals + i, _mm256_add_ps(val_interp, offsets));
+
+        int missing_mask = _mm256_movemask_ps(missing);
+        for (int lane = 0; lane < 8; lane++) {
+            if ((missing_mask >> lane) & 1) {
+                valid[i + lane] = 0;
+            }
+        }
+    }
+    return i;
+}
+
+// asked on first use rather than during static initialization, when the CPU model may not be known yet
+static bool cpu_has_avx2() {
+    static const bool hasAvx2 = (__builtin_cpu_init(), __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"));
+    return hasAvx2;
+}
+#endif
+
+// bilinearly interpolates count points, with AVX2 when the CPU running the program has it
+static void bilinear_row(float *outVals, unsigned char *valid, const float *window, const RowScratch &scratch, int count, float noDataValue, float offset) {
+    int done = 0;
+#if MOONSURFACE_AVX2_KERNEL
+    if (cpu_has_avx2()) {
+        done = bilinear_row_avx2(outVals, valid, window, scratch, count, noDataValue, offset);
+    }
+#endif
+    bilinear_row_scalar(outVals, valid, window, scratch, done, count, noDataValue, offset);
+}
 
 SingleDEM::SingleDEM(std::string filename) {
-    this->dem = GDALDataset::FromHandle(GDALOpen(filename.c_str(), GA_ReadOnly));
-    this->band = this->dem->GetRasterBand(1);
-    this->sphereRadius = this->dem->GetSpatialRef()->GetSemiMajor();
+    this->filename = filename;
+    this->dem = NULL;
+    this->band = NULL;
+    this->opened = false;
+    this->latLonToGeoTransformation = NULL;
+    this->minLat = -90;
+    this->maxLat = 90;
+    this->minLon = -180;
+    this->maxLon = 180;
+    OGRSpatialReference spatialRef;
+    double imageSpaceToGeoSpace[6];
+    // preprocessed DEMs are mapped and read directly, everything else is read through GDAL.
+    // a DEM file that fails to map is broken, GDAL can't read it either
+    this->isMapped = MappedDEMFile::isDemFile(filename);
+    if (this->isMapped) {
+        if (this->mapped.open(filename)) {
+            return;
+        }
+        const DemFileHeader &info = this->mapped.info();
+        this->rasterWidth = info.width;
+        this->rasterHeight = info.height;
+        this->blockWidth = info.tileSize;
+        this->blockHeight = info.tileSize;
+        this->noDataValue = info.noDataValue;
+        std::copy(info.geoTransform, info.geoTransform + 6, imageSpaceToGeoSpace);
+        (void)spatialRef.importFromWkt(this->mapped.projectionWkt().c_str());
+        // match the axis order GDAL gives the spatial references of datasets it opens
+        spatialRef.SetAxisMappingStrategy(OAMS_TRADITIONAL_GIS_ORDER);
+    } else {
+        this->dem = GDALDataset::FromHandle(GDALOpen(filename.c_str(), GA_ReadOnly));
+        if (this->dem == NULL) {
+            std::cout << "Failed to open " << filename << std::endl;
+            return;
+        }
+        this->allHandles.push_back(this->dem);
+        this->spareHandles.push_back(this->dem);
+        this->band = this->dem->GetRasterBand(1);
+        this->rasterWidth = this->dem->GetRasterXSize();
+        this->rasterHeight = this->dem->GetRasterYSize();
+        this->band->GetBlockSize(&this->blockWidth, &this->blockHeight);
+        this->noDataValue = this->band->GetNoDataValue();
+        this->dem->GetGeoTransform(imageSpaceToGeoSpace);
+        spatialRef = *this->dem->GetSpatialRef();
+    }
+    this->cacheId = nextCacheId++;
+    RunStats::nameSource(this->cacheId, filename);
+    this->sphereRadius = spatialRef.GetSemiMajor();
 
-    OGRSpatialReferenceH ref = GDALGetSpatialRef(this->dem);
+    OGRSpatialReferenceH ref = OGRSpatialReference::ToHandle(&spatialRef);
     OGRSpatialReferenceH latLonRef = OSRCloneGeogCS(ref);
 
     OSRSetAxisMappingStrategy(latLonRef, OAMS_TRADITIONAL_GIS_ORDER);
@@ -17,9 +180,6 @@ SingleDEM::SingleDEM(std::string filename) {
 
     OGRCoordinateTransformationH geoToLatLonTransformation = OCTNewCoordinateTransformation(ref, latLonRef);
 
-    double imageSpaceToGeoSpace[6];
-    this->dem->GetGeoTransform(imageSpaceToGeoSpace);
-    
     if (!GDALInvGeoTransform(imageSpaceToGeoSpace, this->geoSpaceToImageSpace)) {
         std::cout << "Failed to invert geotransform" << std::endl;
         this->geoSpaceToImageSpace[0] = 0.0;
@@ -31,9 +191,11 @@ SingleDEM::SingleDEM(std::string filename) {
     }
     this->pixelSize = imageSpaceToGeoSpace[1] * imageSpaceToGeoSpace[5];
 
+    this->setupLinearLatLonToImage(&spatialRef);
+
     this->circumnavigates = false;
-    const char *projectionName = this->dem->GetSpatialRef()->GetAttrValue("projection");
-    if (!strcmp(projectionName, SRS_PT_EQUIRECTANGULAR)) {
+    const char *projectionName = spatialRef.GetAttrValue("projection");
+    if (projectionName != NULL && !strcmp(projectionName, SRS_PT_EQUIRECTANGULAR)) {
         // see if the dataset has a longitude extent of 360 degrees. If so, set this->circumnavigates to true
         double min_lon, max_lon;
         
@@ -46,8 +208,8 @@ SingleDEM::SingleDEM(std::string filename) {
         (void)OCTTransform(geoToLatLonTransformation, 1, &image_column, &image_row, NULL);
         min_lon = image_column;
 
-        x = this->dem->GetRasterXSize();
-        y = this->dem->GetRasterYSize();
+        x = this->rasterWidth;
+        y = this->rasterHeight;
         image_column = imageSpaceToGeoSpace[0] + imageSpaceToGeoSpace[1] * x + imageSpaceToGeoSpace[2] * y;
         image_row = imageSpaceToGeoSpace[3] + imageSpaceToGeoSpace[4] * x + imageSpaceToGeoSpace[5] * y;
         (void)OCTTransform(geoToLatLonTransformation, 1, &image_column, &image_row, NULL);
@@ -59,11 +221,251 @@ SingleDEM::SingleDEM(std::string filename) {
         }
     }
 
+    // the lat lon bounding box is used by DEMManager's spatial index. If it can't be found, assume the DEM could be anywhere
+    this->minLat = -90;
+    this->maxLat = 90;
+    this->minLon = -180;
+    this->maxLon = 180;
+    if (!this->circumnavigates) {
+        double geo_x[4], geo_y[4];
+        for (int corner = 0; corner < 4; corner++) {
+            double x = (corner & 1) ? this->rasterWidth : 0;
+            double y = (corner & 2) ? this->rasterHeight : 0;
+            geo_x[corner] = imageSpaceToGeoSpace[0] + imageSpaceToGeoSpace[1] * x + imageSpaceToGeoSpace[2] * y;
+            geo_y[corner] = imageSpaceToGeoSpace[3] + imageSpaceToGeoSpace[4] * x + imageSpaceToGeoSpace[5] * y;
+        }
+        double min_lon, min_lat, max_lon, max_lat;
+        if (OCTTransformBounds(geoToLatLonTransformation,
+                               *std::min_element(geo_x, geo_x + 4), *std::min_element(geo_y, geo_y + 4),
+                               *std::max_element(geo_x, geo_x + 4), *std::max_element(geo_y, geo_y + 4),
+                               &min_lon, &min_lat, &max_lon, &max_lat, 21)) {
+            this->minLat = min_lat;
+            this->maxLat = max_lat;
+            this->minLon = min_lon;
+            this->maxLon = max_lon;
+        }
+    }
+    OCTDestroyCoordinateTransformation(geoToLatLonTransformation);
+
+    if (this->linearLatLonToImage) {
+        this->pixelDegrees = 1 / hypot(this->latLonToImageSpace[2], this->latLonToImageSpace[5]);
+    } else {
+        // a pixel's height on the ground over the length of a degree of latitude. The bounding box can't be used, since
+        // a polar projection's latitudes only span half of its height. Ground sizes are taken where the projection is
+        // true to scale, and elsewhere its pixels cover a little less ground
+        double pixel_units = hypot(imageSpaceToGeoSpace[2], imageSpaceToGeoSpace[5]);
+        double units_per_degree = this->sphereRadius / spatialRef.GetLinearUnits() * M_PI / 180.0;
+        this->pixelDegrees = pixel_units / (units_per_degree * spatialRef.GetProjParm(SRS_PP_SCALE_FACTOR, 1.0));
+    }
+    this->levels.push_back({this->rasterWidth, this->rasterHeight, this->blockWidth, this->blockHeight, 1, 1, this->cacheId});
+    // mapped DEMs have no overviews, so they are always read at full resolution
+    if (this->band != NULL) {
+        for (int overview_idx = 0; overview_idx < this->band->GetOverviewCount(); overview_idx++) {
+            GDALRasterBand *overview = this->band->GetOverview(overview_idx);
+            if (overview == NULL) {
+                continue;
+            }
+            DEMLevel level;
+            level.rasterWidth = overview->GetXSize();
+            level.rasterHeight = overview->GetYSize();
+            overview->GetBlockSize(&level.blockWidth, &level.blockHeight);
+            level.scaleX = (double)this->rasterWidth / level.rasterWidth;
+            level.scaleY = (double)this->rasterHeight / level.rasterHeight;
+            level.cacheId = nextCacheId++;
+            RunStats::nameSource(level.cacheId, filename + " overview " + std::to_string(overview_idx + 1));
+            this->levels.push_back(level);
+        }
+    }
+    this->opened = true;
+}
+
+bool SingleDEM::isOpen() {
+    return this->opened;
+}
+
+double SingleDEM::levelDegrees(int level) {
+    return this->pixelDegrees * this->levels[level].scaleY;
+}
+
+int SingleDEM::levelFor(double spacing) {
+    int best = 0;
+    for (int level = 1; level < (int)this->levels.size(); level++) {
+        if (this->levelDegrees(level) <= spacing && this->levels[level].scaleY > this->levels[best].scaleY) {
+            best = level;
+        }
+    }
+    return best;
+}
+
+GDALRasterBand *SingleDEM::levelBand(GDALDataset *handle, int level) {
+    GDALRasterBand *band = handle->GetRasterBand(1);
+    return level == 0 ? band : band->GetOverview(level - 1);
+}
+
+// the approximate size of one of the band's blocks in degrees
+void SingleDEM::blockExtent(double *lonDegrees, double *latDegrees) {
+    if (this->linearLatLonToImage) {
+        *lonDegrees = this->blockWidth / fabs(this->latLonToImageSpace[1]);
+        *latDegrees = this->blockHeight / fabs(this->latLonToImageSpace[5]);
+        return;
+    }
+    double max_lon = this->maxLon < this->minLon ? this->maxLon + 360 : this->maxLon;
+    *lonDegrees = this->blockWidth * (max_lon - this->minLon) / this->rasterWidth;
+    *latDegrees = this->blockHeight * (this->maxLat - this->minLat) / this->rasterHeight;
+}
+
+// borrows a dataset handle for reading. Returns the shared one if nobody else is using it, otherwise opens another.
+// returns NULL if another couldn't be opened
+GDALDataset *SingleDEM::acquireHandle() {
+    {
+        std::lock_guard<std::mutex> lock(this->handleMutex);
+        if (!this->spareHandles.empty()) {
+            GDALDataset *handle = this->spareHandles.back();
+            this->spareHandles.pop_back();
+            return handle;
+        }
+    }
+    GDALDataset *handle = GDALDataset::FromHandle(GDALOpen(this->filename.c_str(), GA_ReadOnly));
+    if (handle == NULL) {
+        std::cout << "Failed to open " << this->filename << std::endl;
+        return NULL;
+    }
+    std::lock_guard<std::mutex> lock(this->handleMutex);
+    this->allHandles.push_back(handle);
+    return handle;
+}
+
+void SingleDEM::releaseHandle(GDALDataset *handle) {
+    std::lock_guard<std::mutex> lock(this->handleMutex);
+    this->spareHandles.push_back(handle);
+}
+
+// borrows a lat lon to geo space transformation, cloning another one if every existing one is in use
+OGRCoordinateTransformationH SingleDEM::acquireTransformation() {
+    std::lock_guard<std::mutex> lock(this->handleMutex);
+    if (!this->spareTransformations.empty()) {
+        OGRCoordinateTransformationH transformation = this->spareTransformations.back();
+        this->spareTransformations.pop_back();
+        return transformation;
+    }
+    OGRCoordinateTransformationH transformation = OCTClone(this->latLonToGeoTransformation);
+    this->allTransformations.push_back(transformation);
+    return transformation;
+}
+
+void SingleDEM::releaseTransformation(OGRCoordinateTransformationH transformation) {
+    std::lock_guard<std::mutex> lock(this->handleMutex);
+    this->spareTransformations.push_back(transformation);
+}
+
+// whether a row at this latitude could touch the DEM
+bool SingleDEM::containsLatitude(float lat) {
+    if (lat > 90) {
+        lat = 180 - lat;
+    }
+    if (lat < -90) {
+        lat = -180 - lat;
+    }
+    // leave room for a pixel of bilinear neighbours around the bounding box
+    double margin = 1.0 / indexCellsPerDegree;
+    return lat >= this->minLat - margin && lat <= this->maxLat + margin;
+}
+
+// for geographic and equirectangular (simple cylindrical) DEMs, going from lat lon to image space is linear,
+// so the projection and the geotransform are folded into one map and the per sample PROJ call is skipped
+void SingleDEM::setupLinearLatLonToImage(const OGRSpatialReference *ref) {
+    this->linearLatLonToImage = false;
+    this->wrapsLongitude = false;
+    this->centralMeridian = 0.0;
+
+    // geo space coordinate = geo_offset + geo_scale * (lon - central meridian, lat)
+    double geo_offset[2];
+    double geo_scale[2];
+    if (ref->IsGeographic()) {
+        // the geotransform is already in angular units, only the units might need converting
+        double degrees_to_units = (M_PI / 180.0) / ref->GetAngularUnits();
+        geo_offset[0] = 0.0;
+        geo_offset[1] = 0.0;
+        geo_scale[0] = degrees_to_units;
+        geo_scale[1] = degrees_to_units;
+    } else {
+        const char *projectionName = ref->GetAttrValue("projection");
+        if (projectionName == NULL || (strcmp(projectionName, SRS_PT_EQUIRECTANGULAR) && strcmp(projectionName, "Plate_Carree"))) {
+            return;
+        }
+        // x = false_easting + R * (lon - central_meridian) * cos(standard_parallel)
+        // y = false_northing + R * (lat - latitude_of_origin)
+        double radians_to_units = this->sphereRadius / ref->GetLinearUnits();
+        double standard_parallel = ref->GetProjParm(SRS_PP_STANDARD_PARALLEL_1, 0.0) * M_PI / 180.0;
+        double latitude_of_origin = ref->GetProjParm(SRS_PP_LATITUDE_OF_ORIGIN, 0.0);
+        geo_scale[0] = radians_to_units * cos(standard_parallel) * M_PI / 180.0;
+        geo_scale[1] = radians_to_units * M_PI / 180.0;
+        geo_offset[0] = ref->GetProjParm(SRS_PP_FALSE_EASTING, 0.0);
+        geo_offset[1] = ref->GetProjParm(SRS_PP_FALSE_NORTHING, 0.0) - geo_scale[1] * latitude_of_origin;
+        // PROJ wraps longitudes into +-180 degrees of the central meridian, so do the same
+        this->centralMeridian = ref->GetProjParm(SRS_PP_CENTRAL_MERIDIAN, 0.0);
+        this->wrapsLongitude = true;
+    }
+
+    // column = g[0] + g[1] * x + g[2] * y and row = g[3] + g[4] * x + g[5] * y
+    const double *g = this->geoSpaceToImageSpace;
+    this->latLonToImageSpace[0] = g[0] + g[1] * geo_offset[0] + g[2] * geo_offset[1];
+    this->latLonToImageSpace[1] = g[1] * geo_scale[0];
+    this->latLonToImageSpace[2] = g[2] * geo_scale[1];
+    this->latLonToImageSpace[3] = g[3] + g[4] * geo_offset[0] + g[5] * geo_offset[1];
+    this->latLonToImageSpace[4] = g[4] * geo_scale[0];
+    this->latLonToImageSpace[5] = g[5] * geo_scale[1];
+    this->linearLatLonToImage = true;
 }
-// finds the value at the lat lon position in the DEM
+
+// converts count lon lat pairs (in degrees) to image space columns and rows in place
+// points that can't be projected are set to NaN
+void SingleDEM::toImageSpace(int count, double *lonToColumn, double *latToRow) {
+    if (this->linearLatLonToImage) {
+        const double *m = this->latLonToImageSpace;
+        for (int i = 0; i < count; i++) {
+            double lon = lonToColumn[i] - this->centralMeridian;
+            if (this->wrapsLongitude) {
+                lon -= 360.0 * floor((lon + 180.0) / 360.0);
+            }
+            double lat = latToRow[i];
+            lonToColumn[i] = m[0] + m[1] * lon + m[2] * lat;
+            latToRow[i] = m[3] + m[4] * lon + m[5] * lat;
+        }
+        return;
+    }
+
+    // everything else goes through PROJ, but as one call for all of the points
+    int single_success;
+    std::vector<int> many_success;
+    int *success = &single_success;
+    if (count > 1) {
+        many_success.resize(count);
+        success = many_success.data();
+    }
+    RunStats::add(STAT_TRANSFORM_CALLS, 1);
+    RunStats::add(STAT_TRANSFORMED_POINTS, count);
+    OGRCoordinateTransformationH transformation = this->acquireTransformation();
+    (void)OCTTransformEx(transformation, count, lonToColumn, latToRow, NULL, success);
+    this->releaseTransformation(transformation);
+    const double *g = this->geoSpaceToImageSpace;
+    for (int i = 0; i < count; i++) {
+        if (!success[i]) {
+            lonToColumn[i] = NAN;
+            latToRow[i] = NAN;
+            continue;
+        }
+        double x = lonToColumn[i];
+        double y = latToRow[i];
+        lonToColumn[i] = g[0] + g[1] * x + g[2] * y;
+        latToRow[i] = g[3] + g[4] * x + g[5] * y;
+    }
+}
+
+// finds the value at the lat lon position in the DEM, reading the pixels of the given overview level
 // if the position is not in the DEM, return 1 and don't update outVal or valResolution
 // if the resolution of the DEM is lower than the resolution of the output, don't update outVal
-int SingleDEM::sample(float *outVal, float lat, float lon) {
+int SingleDEM::sample(float *outVal, float lat, float lon, int level) {
     if (lat > 90) {
         lat = 180 - lat;
         lon += 180;
@@ -72,73 +474,51 @@ int SingleDEM::sample(float *outVal, float lat, float lon) {
         lat = -180 - lat;
         lon += 180;
     }
-    double x = lon;
-    double y = lat;
-    
-    // convert lat lon to geo space
-    if (!OCTTransform(this->latLonToGeoTransformation, 1, &x, &y, NULL)) {
+    double image_column = lon;
+    double image_row = lat;
+    this->toImageSpace(1, &image_column, &image_row);
+    if (std::isnan(image_column) || std::isnan(image_row)) {
         return 1;
     }
-    
-    // convert geo space to image space
-    double image_row, image_column;
-    image_column = this->geoSpaceToImageSpace[0] + this->geoSpaceToImageSpace[1] * x + this->geoSpaceToImageSpace[2] * y;
-    image_row = this->geoSpaceToImageSpace[3] + this->geoSpaceToImageSpace[4] * x + this->geoSpaceToImageSpace[5] * y;
-    
+    const DEMLevel &pixels = this->levels[level];
+    image_column = levelCoordinate(image_column, pixels.scaleX);
+    image_row = levelCoordinate(image_row, pixels.scaleY);
+
     int column_floor = (int)floor(image_column);
     int column_ceil = (int)ceil(image_column);
     int row_floor = (int)floor(image_row);
     int row_ceil = (int)ceil(image_row);
     // if the pixel is beyond beyonds, instantly return
-    if (image_row < 0 || image_row >= this->dem->GetRasterYSize() || row_ceil >= this->dem->GetRasterYSize()) {
+    if (image_row < 0 || image_row >= pixels.rasterHeight || row_ceil >= pixels.rasterHeight) {
         return 1;
     }
     // if the DEM circumnavigates the globe, then the column will always be contained in its bounds.
     if (this->circumnavigates) {
         if (column_floor < 0) {
-            column_floor += this->dem->GetRasterXSize();
+            column_floor += pixels.rasterWidth;
         }
         if (column_ceil < 0) {
-            column_ceil += this->dem->GetRasterXSize();
+            column_ceil += pixels.rasterWidth;
         }
-        if (column_floor >= this->dem->GetRasterXSize()) {
-            column_floor -= this->dem->GetRasterXSize();
+        if (column_floor >= pixels.rasterWidth) {
+            column_floor -= pixels.rasterWidth;
         }
-        if (column_ceil >= this->dem->GetRasterXSize()) {
-            column_ceil -= this->dem->GetRasterXSize();
+        if (column_ceil >= pixels.rasterWidth) {
+            column_ceil -= pixels.rasterWidth;
         }
 
     } else {
-        if (image_column < 0 || image_column >= this->dem->GetRasterXSize() || column_ceil >= this->dem->GetRasterXSize()) {
+        if (image_column < 0 || image_column >= pixels.rasterWidth || column_ceil >= pixels.rasterWidth) {
             return 1;
         }
     }
 
     // get the value at the image space position by sampling the raster band at each corner
     // and interpolating the value. If any of the corners are not defined, return 1
-    float val;
-    // top left corner
-    (void)this->band->RasterIO(GF_Read, column_floor, row_floor, 1, 1, &val, 1, 1, GDT_Float32, 0, 0);
-    float val_tl = val;
-    if (this->band->GetNoDataValue() == val_tl) {
-        return 1;
-    }
-    // top right corner
-    (void)this->band->RasterIO(GF_Read, column_ceil, row_floor, 1, 1, &val, 1, 1, GDT_Float32, 0, 0);
-    float val_tr = val;
-    if (this->band->GetNoDataValue() == val_tr) {
-        return 1;
-    }
-    // bottom left corner
-    (void)this->band->RasterIO(GF_Read, column_floor, row_ceil, 1, 1, &val, 1, 1, GDT_Float32, 0, 0);
-    float val_bl = val;
-    if (this->band->GetNoDataValue() == val_bl) {
-        return 1;
-    }
-    // bottom right corner
-    (void)this->band->RasterIO(GF_Read, column_ceil, row_ceil, 1, 1, &val, 1, 1, GDT_Float32, 0, 0);
-    float val_br = val;
-    if (this->band->GetNoDataValue() == val_br) {
+    float val_tl, val_tr, val_bl, val_br;
+    if (this->readPixel(&val_tl, column_floor, row_floor, level) || this->readPixel(&val_tr, column_ceil, row_floor, level) ||
+        this->readPixel(&val_bl, column_floor, row_ceil, level) || this->readPixel(&val_br, column_ceil, row_ceil, level)) {
+        RunStats::add(STAT_NODATA_MISSES, 1);
         return 1;
     }
 
@@ -151,58 +531,492 @@ int SingleDEM::sample(float *outVal, float lat, float lon) {
         
     // the dem is just an elevation above the sphere radius, so add the sphere radius to get the distance from the center to the surface
     *outVal = val_interp + this->sphereRadius;
+    RunStats::served(pixels.cacheId, 1);
 
     return 0;
 }
 
+// samples count points, which may be spread over a whole grid. The DEM window covering all of them is read once,
+// from the thread's block cache (split in two if it crosses the antimeridian), and every point is interpolated from it.
+// valid[i] is set to 1 if the point had data, and outVals[i] is only meaningful where it is
+void SingleDEM::samplePoints(float *outVals, unsigned char *valid, const float *lats, const float *lons, int count, int level) {
+    RowScratch &scratch = rowScratch;
+    scratch.columns.resize(count);
+    scratch.rows.resize(count);
+    scratch.tl.resize(count);
+    scratch.tr.resize(count);
+    scratch.bl.resize(count);
+    scratch.br.resize(count);
+    scratch.x_frac.resize(count);
+    scratch.y_frac.resize(count);
+    for (int i = 0; i < count; i++) {
+        float lat = lats[i];
+        float lon = lons[i];
+        if (lat > 90) {
+            lat = 180 - lat;
+            lon += 180;
+        }
+        if (lat < -90) {
+            lat = -180 - lat;
+            lon += 180;
+        }
+        scratch.columns[i] = lon;
+        scratch.rows[i] = lat;
+    }
+    this->toImageSpace(count, scratch.columns.data(), scratch.rows.data());
+    const DEMLevel &pixels = this->levels[level];
+
+    // find which points are in bounds and the window that covers all of their corners
+    int min_column = INT_MAX;
+    int max_column = INT_MIN;
+    int min_row = INT_MAX;
+    int max_row = INT_MIN;
+    for (int i = 0; i < count; i++) {
+        double image_column = levelCoordinate(scratch.columns[i], pixels.scaleX);
+        double image_row = levelCoordinate(scratch.rows[i], pixels.scaleY);
+        valid[i] = 0;
+        if (std::isnan(image_column) || std::isnan(image_row)) {
+            continue;
+        }
+        int column_floor = (int)floor(image_column);
+        int column_ceil = (int)ceil(image_column);
+        int row_floor = (int)floor(image_row);
+        int row_ceil = (int)ceil(image_row);
+        if (image_row < 0 || image_row >= pixels.rasterHeight || row_ceil >= pixels.rasterHeight) {
+            continue;
+        }
+        if (!this->circumnavigates && (image_column < 0 || image_column >= pixels.rasterWidth || column_ceil >= pixels.rasterWidth)) {
+            continue;
+        }
+        valid[i] = 1;
+        // corners are kept as unwrapped columns and rows until the window is known
+        scratch.tl[i] = column_floor;
+        scratch.tr[i] = column_ceil;
+        scratch.bl[i] = row_floor;
+        scratch.br[i] = row_ceil;
+        scratch.x_frac[i] = image_column - floor(image_column);
+        scratch.y_frac[i] = image_row - floor(image_row);
+        min_column = std::min(min_column, column_floor);
+        max_column = std::max(max_column, column_ceil);
+        min_row = std::min(min_row, row_floor);
+        max_row = std::max(max_row, row_ceil);
+    }
+    if (min_column == INT_MAX) {
+        return;
+    }
+
+    // points that go all the way around a circumnavigating DEM just read every column
+    bool full_width = this->circumnavigates && (max_column - min_column + 1 >= pixels.rasterWidth);
+    if (full_width) {
+        min_column = 0;
+        max_column = pixels.rasterWidth - 1;
+    }
+    int window_width = max_column - min_column + 1;
+    int window_height = max_row - min_row + 1;
+    if ((size_t)window_width * window_height > maxWindowPixels) {
+        for (int i = 0; i < count; i++) {
+            if (valid[i]) {
+                valid[i] = !this->sample(&outVals[i], lats[i], lons[i], level);
+            }
+        }
+        return;
+    }
+
+    scratch.window.resize((size_t)window_width * window_height);
+    float *window = scratch.window.data();
+    // split the read where the window crosses the edge of a circumnavigating DEM
+    bool read_failed = false;
+    int column = min_column;
+    while (column <= max_column) {
+        int source_column = column % pixels.rasterWidth;
+        if (source_column < 0) {
+            source_column += pixels.rasterWidth;
+        }
+        int segment_width = std::min(max_column - column + 1, pixels.rasterWidth - source_column);
+        if (this->isMapped) {
+            this->mapped.readWindow(window + (column - min_column), source_column, min_row, segment_width, window_height, window_width, this->noDataValue);
+        } else if (this->readWindow(window + (column - min_column), source_column, min_row, segment_width, window_height, window_width, level)) {
+            read_failed = true;
+            break;
+        }
+        column += segment_width;
+    }
+    // a window that couldn't be read has no data, rather than whatever was left in the buffer
+    if (read_failed) {
+        int in_bounds = 0;
+        for (int i = 0; i < count; i++) {
+            in_bounds += valid[i];
+            valid[i] = 0;
+        }
+        RunStats::add(STAT_NODATA_MISSES, in_bounds);
+        return;
+    }
+
+    // turn the corners into indices into the window. Invalid points point at the first pixel so they can still be gathered
+    int in_bounds = 0;
+    for (int i = 0; i < count; i++) {
+        in_bounds += valid[i];
+        if (!valid[i]) {
+            scratch.tl[i] = 0;
+            scratch.tr[i] = 0;
+            scratch.bl[i] = 0;
+            scratch.br[i] = 0;
+            scratch.x_frac[i] = 0;
+            scratch.y_frac[i] = 0;
+            continue;
+        }
+        int column_floor = scratch.tl[i];
+        int column_ceil = scratch.tr[i];
+        if (full_width) {
+            column_floor = ((column_floor % pixels.rasterWidth) + pixels.rasterWidth) % pixels.rasterWidth;
+            column_ceil = ((column_ceil % pixels.rasterWidth) + pixels.rasterWidth) % pixels.rasterWidth;
+        } else {
+            column_floor -= min_column;
+            column_ceil -= min_column;
+        }
+        int row_floor = (scratch.bl[i] - min_row) * window_width;
+        int row_ceil = (scratch.br[i] - min_row) * window_width;
+        scratch.tl[i] = row_floor + column_floor;
+        scratch.tr[i] = row_floor + column_ceil;
+        scratch.bl[i] = row_ceil + column_floor;
+        scratch.br[i] = row_ceil + column_ceil;
+    }
+
+    // the dem is just an elevation above the sphere radius, so add the sphere radius to get the distance from the center to the surface
+    bilinear_row(outVals, valid, window, scratch, count, this->noDataValue, this->sphereRadius);
+    int served = 0;
+    for (int i = 0; i < count; i++) {
+        served += valid[i];
+    }
+    RunStats::served(pixels.cacheId, served);
+    RunStats::add(STAT_NODATA_MISSES, in_bounds - served);
+}
+
+// finds a block of a level in the thread's block cache, reading and decoding it on a miss.
+// the block stays valid until the next block is read. Returns 1 if it couldn't be read
+int SingleDEM::readBlock(const float **outBlock, int block_x, int block_y, int level) {
+    const DEMLevel &pixels = this->levels[level];
+    BlockCache &cache = BlockCache::local();
+    uint64_t key = BlockCache::makeKey(pixels.cacheId, block_x, block_y);
+    const float *block = cache.find(key);
+    if (block == NULL) {
+        // blocks on the right and bottom edges may be partial, but are stored with the full block stride
+        int x_off = block_x * pixels.blockWidth;
+        int y_off = block_y * pixels.blockHeight;
+        int x_size = std::min(pixels.blockWidth, pixels.rasterWidth - x_off);
+        int y_size = std::min(pixels.blockHeight, pixels.rasterHeight - y_off);
+        GDALDataset *handle = this->acquireHandle();
+        if (handle == NULL) {
+            readFailed = true;
+            return 1;
+        }
+        float *data = cache.insert(key, (size_t)pixels.blockWidth * pixels.blockHeight);
+        RunStats::add(STAT_RASTER_IO_CALLS, 1);
+        CPLErr error = this->levelBand(handle, level)->RasterIO(GF_Read, x_off, y_off, x_size, y_size, data, x_size, y_size, GDT_Float32, sizeof(float), sizeof(float) * pixels.blockWidth);
+        this->releaseHandle(handle);
+        // don't keep a block that failed to read, or its garbage would be served as heights for the rest of the run
+        if (error != CE_None) {
+            std::cout << "Failed to read " << this->filename << std::endl;
+            cache.erase(key);
+            readFailed = true;
+            return 1;
+        }
+        block = data;
+    }
+    *outBlock = block;
+    return 0;
+}
+
+// copies a window of a level's pixels out of the blocks that cover it, with stride floats between rows.
+// returns 1 if a block couldn't be read
+int SingleDEM::readWindow(float *outVals, int column, int row, int width, int height, size_t stride, int level) {
+    const DEMLevel &pixels = this->levels[level];
+    for (int block_y = row / pixels.blockHeight; block_y <= (row + height - 1) / pixels.blockHeight; block_y++) {
+        int first_row = std::max(row, block_y * pixels.blockHeight);
+        int last_row = std::min(row + height, (block_y + 1) * pixels.blockHeight);
+        for (int block_x = column / pixels.blockWidth; block_x <= (column + width - 1) / pixels.blockWidth; block_x++) {
+            int first_column = std::max(column, block_x * pixels.blockWidth);
+            int last_column = std::min(column + width, (block_x + 1) * pixels.blockWidth);
+            const float *block;
+            if (this->readBlock(&block, block_x, block_y, level)) {
+                return 1;
+            }
+            for (int block_row = first_row; block_row < last_row; block_row++) {
+                const float *source = block + (size_t)(block_row - block_y * pixels.blockHeight) * pixels.blockWidth + (first_column - block_x * pixels.blockWidth);
+                memcpy(outVals + (size_t)(block_row - row) * stride + (first_column - column), source, (last_column - first_column) * sizeof(float));
+            }
+        }
+    }
+    return 0;
+}
+
+// reads a single pixel through the thread's block cache. Mapped DEMs are already decoded, so they are read directly.
+// column and row are pixels of the given overview level. Returns 1 if the pixel is nodata or couldn't be read
+int SingleDEM::readPixel(float *outVal, int column, int row, int level) {
+    if (this->isMapped) {
+        return this->mapped.read(outVal, column, row);
+    }
+    const DEMLevel &pixels = this->levels[level];
+    int block_x = column / pixels.blockWidth;
+    int block_y = row / pixels.blockHeight;
+    const float *block;
+    if (this->readBlock(&block, block_x, block_y, level)) {
+        return 1;
+    }
+    *outVal = block[(size_t)(row - block_y * pixels.blockHeight) * pixels.blockWidth + (column - block_x * pixels.blockWidth)];
+    if (*outVal == this->noDataValue) {
+        return 1;
+    }
+    return 0;
+}
+
 void SingleDEM::close() {
-    GDALClose(this->dem);
+    this->mapped.close();
+    for (GDALDataset *handle : this->allHandles) {
+        GDALClose(handle);
+    }
+    this->allHandles.clear();
+    this->spareHandles.clear();
+    for (OGRCoordinateTransformationH transformation : this->allTransformations) {
+        OCTDestroyCoordinateTransformation(transformation);
+    }
+    this->allTransformations.clear();
+    this->spareTransformations.clear();
 }
 
 DEMManager::DEMManager(std::vector<std::string> filenames) {
+    std::vector<std::unique_ptr<SingleDEM>> opened;
+    this->opened = true;
     for (std::string filename : filenames) {
-        this->dems.push_back(SingleDEM(filename));
+        std::unique_ptr<SingleDEM> dem(new SingleDEM(filename));
+        if (!dem->isOpen()) {
+            this->opened = false;
+            continue;
+        }
+        opened.push_back(std::move(dem));
+    }
+    // finest DEMs first, so the first DEM with data at a point is the one to use
+    std::vector<int> order(opened.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&opened](int a, int b) {
+        return opened[a]->levelDegrees(0) < opened[b]->levelDegrees(0);
+    });
+    for (int dem_idx : order) {
+        this->dems.push_back(std::move(opened[dem_idx]));
+    }
+
+    // list each DEM in every cell its bounding box touches, padded by a cell on every side
+    this->cells.resize(indexWidth * indexHeight);
+    for (int dem_idx = 0; dem_idx < (int)this->dems.size(); dem_idx++) {
+        SingleDEM &dem = *this->dems[dem_idx];
+        int min_row = std::max(0, (int)floor((dem.minLat + 90) * indexCellsPerDegree) - 1);
+        int max_row = std::min(indexHeight - 1, (int)floor((dem.maxLat + 90) * indexCellsPerDegree) + 1);
+        double max_lon = dem.maxLon;
+        if (max_lon < dem.minLon) {
+            max_lon += 360;
+        }
+        int min_column = (int)floor((dem.minLon + 180) * indexCellsPerDegree) - 1;
+        int max_column = (int)floor((max_lon + 180) * indexCellsPerDegree) + 1;
+        if (max_column - min_column + 1 >= indexWidth) {
+            min_column = 0;
+            max_column = indexWidth - 1;
+        }
+        for (int row = min_row; row <= max_row; row++) {
+            for (int column = min_column; column <= max_column; column++) {
+                int wrapped_column = ((column % indexWidth) + indexWidth) % indexWidth;
+                this->cells[row * indexWidth + wrapped_column].push_back(dem_idx);
+            }
+        }
+    }
+}
+
+// the index of the spatial index cell holding the point
+static int index_cell(float lat, float lon) {
+    if (lat > 90) {
+        lat = 180 - lat;
+        lon += 180;
+    }
+    if (lat < -90) {
+        lat = -180 - lat;
+        lon += 180;
     }
+    int row = std::min(indexHeight - 1, std::max(0, (int)floor((lat + 90) * indexCellsPerDegree)));
+    int column = ((int)floor((lon + 180) * indexCellsPerDegree) % indexWidth + indexWidth) % indexWidth;
+    return row * indexWidth + column;
+}
+
+// the DEMs that may contain the point, finest first
+const std::vector<int> &DEMManager::candidates(float lat, float lon) {
+    return this->cells[index_cell(lat, lon)];
+}
+
+// picks a size in vertices for the tiles a mesh is sampled in, so a tile covers about one block of the finest DEM
+void DEMManager::tileSize(float vertsPerDegree, int *outWidth, int *outHeight) {
+    *outWidth = 64;
+    *outHeight = 64;
+    if (this->dems.empty()) {
+        return;
+    }
+    double lon_degrees, lat_degrees;
+    this->dems[0]->blockExtent(&lon_degrees, &lat_degrees);
+    // striped DEMs have very wide, very short blocks, so keep tiles within reason either way
+    *outWidth = std::min(256, std::max(16, (int)round(lon_degrees * vertsPerDegree)));
+    *outHeight = std::min(256, std::max(16, (int)round(lat_degrees * vertsPerDegree)));
 }
 
 float DEMManager::sample(float lat, float lon) {
-    float val = -INFINITY;
-    double demResolution = INFINITY;
-    for (SingleDEM dem : this->dems) {
-        float val2;
-        if (!dem.sample(&val2, lat, lon)) {
-            if (fabs(dem.pixelSize) < demResolution) {
-                val = val2;
-                demResolution = dem.pixelSize;
+    RunStats::add(STAT_SAMPLES, 1);
+    for (int dem_idx : this->candidates(lat, lon)) {
+        float val;
+        if (!this->dems[dem_idx]->sample(&val, lat, lon)) {
+            return val;
+        }
+    }
+    RunStats::add(STAT_UNSERVED, 1);
+    std::cout << "No DEMs contained the point " << lat << " " << lon << std::endl;
+    return -INFINITY;
+}
+
+// the order to try the DEMs in and the level to read each of them at for a mesh spacing, as pairs of DEM index and level.
+// without a spacing that's every DEM at full resolution, finest first. Otherwise DEMs are ranked by the resolution they
+// can actually contribute, which is never finer than the spacing. Ties keep the finest first order, so neighbouring
+// meshes at different spacings draw on the same DEM wherever it resolves them both
+static const std::vector<std::pair<int, int>> &sampling_plan(const std::vector<std::unique_ptr<SingleDEM>> &dems, double spacing) {
+    static thread_local std::vector<std::pair<int, int>> plan;
+    plan.clear();
+    for (int dem_idx = 0; dem_idx < (int)dems.size(); dem_idx++) {
+        plan.push_back({dem_idx, spacing > 0 ? dems[dem_idx]->levelFor(spacing) : 0});
+    }
+    if (spacing > 0) {
+        std::stable_sort(plan.begin(), plan.end(), [&dems, spacing](const std::pair<int, int> &a, const std::pair<int, int> &b) {
+            double a_degrees = dems[a.first]->levelDegrees(a.second);
+            double b_degrees = dems[b.first]->levelDegrees(b.second);
+            return std::max(a_degrees, spacing) < std::max(b_degrees, spacing);
+        });
+    }
+    return plan;
+}
+
+// samples a row of points, using the finest DEM that has data at each point. Returns 1 if a DEM couldn't be read
+int DEMManager::sampleRow(float *outVals, float lat, const float *lons, int count, double spacing) {
+    return this->sampleGrid(outVals, &lat, 1, lons, count, spacing);
+}
+
+// samples a regular grid of rows * count points into outVals, using the finest DEM that has data at each point.
+// each DEM reads one window covering the points that the finer DEMs before it didn't have.
+// returns 1 if a DEM couldn't be read, in which case some of the points may be missing
+int DEMManager::sampleGrid(float *outVals, const float *lats, int rows, const float *lons, int count, double spacing) {
+    static thread_local std::vector<int> pending;
+    static thread_local std::vector<int> stillPending;
+    static thread_local std::vector<float> pendingLats;
+    static thread_local std::vector<float> pendingLons;
+    static thread_local std::vector<float> demVals;
+    static thread_local std::vector<unsigned char> demValid;
+    static thread_local std::vector<unsigned char> nearby;
+    int total = rows * count;
+    RunStats::add(STAT_SAMPLES, total);
+    readFailed = false;
+    pending.resize(total);
+    std::iota(pending.begin(), pending.end(), 0);
+    std::fill(outVals, outVals + total, -INFINITY);
+
+    // only the DEMs listed in the index cells under the grid are looked at
+    nearby.assign(this->dems.size(), 0);
+    for (int row = 0; row < rows; row++) {
+        int last_cell = -1;
+        for (int i = 0; i < count; i++) {
+            int cell = index_cell(lats[row], lons[i]);
+            if (cell == last_cell) {
+                continue;
+            }
+            last_cell = cell;
+            for (int dem_idx : this->cells[cell]) {
+                nearby[dem_idx] = 1;
+            }
+        }
+    }
+
+    for (const std::pair<int, int> &step : sampling_plan(this->dems, spacing)) {
+        SingleDEM *dem = this->dems[step.first].get();
+        if (pending.empty()) {
+            break;
+        }
+        if (!nearby[step.first]) {
+            continue;
+        }
+        // points on latitudes the DEM doesn't reach stay pending without being looked at
+        stillPending.clear();
+        pendingLats.clear();
+        pendingLons.clear();
+        int sampled_count = 0;
+        for (int idx : pending) {
+            float lat = lats[idx / count];
+            if (!dem->containsLatitude(lat)) {
+                stillPending.push_back(idx);
+                continue;
             }
+            pending[sampled_count++] = idx;
+            pendingLats.push_back(lat);
+            pendingLons.push_back(lons[idx % count]);
         }
+        if (sampled_count == 0) {
+            continue;
+        }
+        demVals.resize(sampled_count);
+        demValid.resize(sampled_count);
+        dem->samplePoints(demVals.data(), demValid.data(), pendingLats.data(), pendingLons.data(), sampled_count, step.second);
+        for (int i = 0; i < sampled_count; i++) {
+            if (demValid[i]) {
+                outVals[pending[i]] = demVals[i];
+            } else {
+                stillPending.push_back(pending[i]);
+            }
+        }
+        pending.swap(stillPending);
     }
-    if (val == -INFINITY) {
-        std::cout << "No DEMs contained the point " << lat << " " << lon << std::endl;
+    RunStats::add(STAT_UNSERVED, pending.size());
+    for (int idx : pending) {
+        std::cout << "No DEMs contained the point " << lats[idx / count] << " " << lons[idx % count] << std::endl;
     }
-    return val;
+    return readFailed ? 1 : 0;
 }
 
 void DEMManager::getCartesian(std::array<float, 3> *outPoint, float lat, float lon) {
-    float val = this->sample(lat, lon);
+    DEMManager::toCartesian(outPoint, this->sample(lat, lon), lat, lon);
+}
+
+void DEMManager::getCartesian(std::array<float, 3> *outPoint, float lat, float lon, float scale) {
+    DEMManager::toCartesian(outPoint, this->sample(lat, lon), lat, lon, scale);
+}
+
+void DEMManager::getCartesian(std::array<float, 3> *outPoint, float lat, float lon, float center_lat, float center_lon, float center_elevation) {
+    DEMManager::toCartesian(outPoint, this->sample(lat, lon), lat, lon, center_lat, center_lon, center_elevation);
+}
+
+void DEMManager::getCartesian(std::array<float, 3> *outPoint, float lat, float lon, float center_lat, float center_lon, float center_elevation, float scale) {
+    DEMManager::toCartesian(outPoint, this->sample(lat, lon), lat, lon, center_lat, center_lon, center_elevation, scale);
+}
+
+// the toCartesian functions turn an already sampled radius into a point, so batch sampled rows can reuse them
+void DEMManager::toCartesian(std::array<float, 3> *outPoint, float radius, float lat, float lon) {
     float lat_radians = lat * M_PI / 180.0;
     float lon_radians = lon * M_PI / 180.0;
-    (*outPoint)[0] = val * cos(lat_radians) * cos(lon_radians);
-    (*outPoint)[1] = val * cos(lat_radians) * sin(lon_radians);
-    (*outPoint)[2] = val * sin(lat_radians);
+    (*outPoint)[0] = radius * cos(lat_radians) * cos(lon_radians);
+    (*outPoint)[1] = radius * cos(lat_radians) * sin(lon_radians);
+    (*outPoint)[2] = radius * sin(lat_radians);
     return;
 }
 
-void DEMManager::getCartesian(std::array<float, 3> *outPoint, float lat, float lon, float scale) {
-    this->getCartesian(outPoint, lat, lon);
+void DEMManager::toCartesian(std::array<float, 3> *outPoint, float radius, float lat, float lon, float scale) {
+    DEMManager::toCartesian(outPoint, radius, lat, lon);
     (*outPoint)[0] *= scale;
     (*outPoint)[1] *= scale;
     (*outPoint)[2] *= scale;
     return;
 }
 
-void DEMManager::getCartesian(std::array<float, 3> *outPoint, float lat, float lon, float center_lat, float center_lon, float center_elevation) {
-    this->getCartesian(outPoint, lat, lon);
+void DEMManager::toCartesian(std::array<float, 3> *outPoint, float radius, float lat, float lon, float center_lat, float center_lon, float center_elevation) {
+    DEMManager::toCartesian(outPoint, radius, lat, lon);
     
     // rotate the point by center lon degrees around the z axis
     float center_lon_radians = center_lon * M_PI / 180.0;
@@ -223,16 +1037,118 @@ void DEMManager::getCartesian(std::array<float, 3> *outPoint, float lat, float l
     return;
 }
 
-void DEMManager::getCartesian(std::array<float, 3> *outPoint, float lat, float lon, float center_lat, float center_lon, float center_elevation, float scale) {
-    this->getCartesian(outPoint, lat, lon, center_lat, center_lon, center_elevation);
+void DEMManager::toCartesian(std::array<float, 3> *outPoint, float radius, float lat, float lon, float center_lat, float center_lon, float center_elevation, float scale) {
+    DEMManager::toCartesian(outPoint, radius, lat, lon, center_lat, center_lon, center_elevation);
     (*outPoint)[0] *= scale;
     (*outPoint)[1] *= scale;
     (*outPoint)[2] *= scale;
     return;
 }
 
+CartesianTransform DEMManager::scaleTransform(float scale) {
+    CartesianTransform transform;
+    for (int row = 0; row < 3; row++) {
+        for (int column = 0; column < 3; column++) {
+            transform.matrix[row][column] = row == column ? scale : 0.0;
+        }
+        transform.translation[row] = 0.0;
+    }
+    return transform;
+}
+
+// the same rotations and translation as the rotate flat toCartesian, as one matrix:
+// scale * (rotate about y by -(90 - center lat)) * (rotate about z by -center lon), then down by the scaled center elevation
+CartesianTransform DEMManager::rotateFlatTransform(float center_lat, float center_lon, float center_elevation, float scale) {
+    double lon_radians = center_lon * M_PI / 180.0;
+    double lat_radians = (-(90.0 - center_lat)) * M_PI / 180.0;
+    double cos_lon = cos(lon_radians);
+    double sin_lon = sin(lon_radians);
+    double cos_lat = cos(lat_radians);
+    double sin_lat = sin(lat_radians);
+    double rotate_z[3][3] = {{cos_lon, sin_lon, 0}, {-sin_lon, cos_lon, 0}, {0, 0, 1}};
+    double rotate_y[3][3] = {{cos_lat, 0, sin_lat}, {0, 1, 0}, {-sin_lat, 0, cos_lat}};
+    CartesianTransform transform;
+    for (int row = 0; row < 3; row++) {
+        for (int column = 0; column < 3; column++) {
+            double sum = 0;
+            for (int k = 0; k < 3; k++) {
+                sum += rotate_y[row][k] * rotate_z[k][column];
+            }
+            transform.matrix[row][column] = scale * sum;
+        }
+    }
+    transform.translation[0] = 0;
+    transform.translation[1] = 0;
+    transform.translation[2] = -(double)center_elevation * scale;
+    return transform;
+}
+
+void DEMManager::toCartesian(std::array<float, 3> *outPoint, float radius, double lat, double lon, const CartesianTransform &transform) {
+    double lat_radians = lat * M_PI / 180.0;
+    double lon_radians = lon * M_PI / 180.0;
+    double direction[3] = {cos(lat_radians) * cos(lon_radians), cos(lat_radians) * sin(lon_radians), sin(lat_radians)};
+    for (int axis = 0; axis < 3; axis++) {
+        const double *m = transform.matrix[axis];
+        (*outPoint)[axis] = radius * (m[0] * direction[0] + m[1] * direction[1] + m[2] * direction[2]) + transform.translation[axis];
+    }
+}
+
+// turns a row of radii on a line of latitude into points, with the trig of the latitude and of each longitude already computed.
+// the matrix is folded with the latitude terms first, so each point is a few multiply adds with no branches,
+// and the output is a structure of arrays so the loop vectorizes
+void DEMManager::toCartesianRow(float *outX, float *outY, float *outZ, const float *radii, double cosLat, double sinLat,
+                                const double *cosLons, const double *sinLons, int count, const CartesianTransform &transform) {
+    float *outs[3] = {outX, outY, outZ};
+    for (int axis = 0; axis < 3; axis++) {
+        const double *m = transform.matrix[axis];
+        double a = m[0] * cosLat;
+        double b = m[1] * cosLat;
+        double c = m[2] * sinLat;
+        double translation = transform.translation[axis];
+        float *out = outs[axis];
+        for (int i = 0; i < count; i++) {
+            out[i] = radii[i] * (a * cosLons[i] + b * sinLons[i] + c) + translation;
+        }
+    }
+}
+
+bool DEMManager::isOpen() {
+    return this->opened;
+}
+
 void DEMManager::close() {
-    for (SingleDEM dem : this->dems) {
-        dem.close();
+    for (std::unique_ptr<SingleDEM> &dem : this->dems) {
+        dem->close();
+    }
+}
+
+int build_overviews(std::string filename) {
+    std::cout << "Building overviews of " << filename << std::endl;
+    // opening read only makes GDAL write the overviews to an external .ovr file instead of changing the DEM
+    GDALDataset *dataset = GDALDataset::FromHandle(GDALOpen(filename.c_str(), GA_ReadOnly));
+    if (dataset == NULL) {
+        std::cout << "Failed to open " << filename << std::endl;
+        return 1;
+    }
+    int block_width, block_height;
+    dataset->GetRasterBand(1)->GetBlockSize(&block_width, &block_height);
+    int smallest = std::max(256, std::min(block_width, block_height));
+    std::vector<int> factors;
+    for (int factor = 2; std::max(dataset->GetRasterXSize(), dataset->GetRasterYSize()) / (factor / 2) > smallest; factor *= 2) {
+        factors.push_back(factor);
+    }
+    if (factors.empty()) {
+        std::cout << filename << " is too small to need overviews" << std::endl;
+        GDALClose(dataset);
+        return 0;
     }
+    int band_list[1] = {1};
+    // averaging low pass filters each level, so coarse meshes sampled from it don't alias
+    if (dataset->BuildOverviews("AVERAGE", factors.size(), factors.data(), 1, band_list, NULL, NULL) != CE_None) {
+        std::cout << "Failed to build overviews of " << filename << std::endl;
+        GDALClose(dataset);
+        return 1;
+    }
+    GDALClose(dataset);
+    return 0;
 }
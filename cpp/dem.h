@@ -1,35 +1,142 @@
 #pragma once
 #include <string>
+#include <vector>
+#include <array>
+#include <memory>
+#include <mutex>
 #include <gdal_priv.h>
+#include "demfile.h"
+
+// one level of a DEM's overview pyramid. Level 0 is the full resolution raster, level n is the band's overview n - 1
+struct DEMLevel {
+    int rasterWidth;
+    int rasterHeight;
+    int blockWidth;
+    int blockHeight;
+    // full resolution pixels per pixel of this level
+    double scaleX;
+    double scaleY;
+    int cacheId;
+};
 
 class SingleDEM {
     // constructor that takes a filename
     // function that samples a point from the DEM
     private:
+        std::string filename;
         GDALDataset *dem;
         GDALRasterBand *band;
+        // preprocessed DEMs are mapped instead of opened with GDAL, and need no handles
+        bool isMapped;
+        MappedDEMFile mapped;
+        // GDAL datasets can't be read from several threads at once, so each concurrent reader borrows its own handle.
+        // handles are opened on demand and kept for reuse
+        std::mutex handleMutex;
+        std::vector<GDALDataset *> spareHandles;
+        std::vector<GDALDataset *> allHandles;
+        // PROJ transformations aren't thread safe either, so each concurrent caller borrows a clone of this one,
+        // which is only ever cloned. Clones are kept for reuse under handleMutex like the handles
         OGRCoordinateTransformationH latLonToGeoTransformation;
+        std::vector<OGRCoordinateTransformationH> spareTransformations;
+        std::vector<OGRCoordinateTransformationH> allTransformations;
         double geoSpaceToImageSpace[6];
+        // projection and geotransform folded into one linear map from (lon - central meridian, lat) to (column, row)
+        bool linearLatLonToImage;
+        bool wrapsLongitude;
+        double centralMeridian;
+        double latLonToImageSpace[6];
         double sphereRadius;
         bool circumnavigates;
+        int rasterWidth;
+        int rasterHeight;
+        int blockWidth;
+        int blockHeight;
+        float noDataValue;
+        int cacheId;
+        bool opened;
+        std::vector<DEMLevel> levels;
+        // approximate degrees of latitude per full resolution pixel
+        double pixelDegrees;
+        int readPixel(float *outVal, int column, int row, int level);
+        int readBlock(const float **outBlock, int block_x, int block_y, int level);
+        int readWindow(float *outVals, int column, int row, int width, int height, size_t stride, int level);
+        GDALRasterBand *levelBand(GDALDataset *handle, int level);
+        void setupLinearLatLonToImage(const OGRSpatialReference *ref);
+        GDALDataset *acquireHandle();
+        void releaseHandle(GDALDataset *handle);
+        OGRCoordinateTransformationH acquireTransformation();
+        void releaseTransformation(OGRCoordinateTransformationH transformation);
     public:
         double pixelSize;
+        // lat lon bounding box of the DEM in degrees. minLon > maxLon if the DEM crosses the antimeridian
+        double minLat;
+        double maxLat;
+        double minLon;
+        double maxLon;
         SingleDEM(std::string filename);
-        int sample(float *outVal, float lat, float lon);
+        SingleDEM(const SingleDEM &) = delete;
+        SingleDEM &operator=(const SingleDEM &) = delete;
+        // false if the file couldn't be opened, in which case nothing else may be called but close
+        bool isOpen();
+        bool containsLatitude(float lat);
+        void blockExtent(double *lonDegrees, double *latDegrees);
+        // the coarsest level whose pixels are no bigger than spacing degrees, 0 if spacing is 0
+        int levelFor(double spacing);
+        // approximate degrees of latitude per pixel of a level
+        double levelDegrees(int level);
+        int sample(float *outVal, float lat, float lon, int level = 0);
+        void samplePoints(float *outVals, unsigned char *valid, const float *lats, const float *lons, int count, int level = 0);
+        void toImageSpace(int count, double *lonToColumn, double *latToRow);
         void close();
 };
 
+// maps a point from planet centered space into mesh space as matrix * point + translation.
+// rotate flat and scale are folded into the one matrix, so a vertex costs a single matrix multiply
+struct CartesianTransform {
+    double matrix[3][3];
+    double translation[3];
+};
+
 class DEMManager {
     // constructor that takes a list of filenames
     // function that samples a point from the DEM
+    // DEMs are sorted from finest to coarsest, and every 1 degree cell lists the DEMs that may cover it,
+    // so a query only visits nearby DEMs and stops at the first one with data.
+    // rows and grids can be sampled for a mesh spacing, in which case each DEM is read from the coarsest overview that
+    // still resolves it. DEMs at least as fine as the spacing keep their finest first order, so meshes at different
+    // spacings take their heights from the same DEM.
+    // a single DEMManager is safe to share between threads
     private:
-        std::vector<SingleDEM> dems;
+        std::vector<std::unique_ptr<SingleDEM>> dems;
+        std::vector<std::vector<int>> cells;
+        bool opened;
+        const std::vector<int> &candidates(float lat, float lon);
     public: 
         DEMManager(std::vector<std::string> filenames);
+        // false if any of the DEMs couldn't be opened
+        bool isOpen();
         float sample(float lat, float lon);
+        void tileSize(float vertsPerDegree, int *outWidth, int *outHeight);
+        // spacing is the distance between output samples in degrees. 0 reads every DEM at full resolution.
+        // both return 1 if a DEM couldn't be read
+        int sampleRow(float *outVals, float lat, const float *lons, int count, double spacing = 0);
+        int sampleGrid(float *outVals, const float *lats, int rows, const float *lons, int count, double spacing = 0);
         void getCartesian(std::array<float, 3> *outPoint, float lat, float lon);
         void getCartesian(std::array<float, 3> *outPoint, float lat, float lon, float scale);
         void getCartesian(std::array<float, 3> *outPoint, float lat, float lon, float center_lat, float center_lon, float center_elevation);
         void getCartesian(std::array<float, 3> *outPoint, float lat, float lon, float center_lat, float center_lon, float center_elevation, float scale);
+        static void toCartesian(std::array<float, 3> *outPoint, float radius, float lat, float lon);
+        static void toCartesian(std::array<float, 3> *outPoint, float radius, float lat, float lon, float scale);
+        static void toCartesian(std::array<float, 3> *outPoint, float radius, float lat, float lon, float center_lat, float center_lon, float center_elevation);
+        static void toCartesian(std::array<float, 3> *outPoint, float radius, float lat, float lon, float center_lat, float center_lon, float center_elevation, float scale);
+        static CartesianTransform scaleTransform(float scale);
+        static CartesianTransform rotateFlatTransform(float center_lat, float center_lon, float center_elevation, float scale);
+        static void toCartesian(std::array<float, 3> *outPoint, float radius, double lat, double lon, const CartesianTransform &transform);
+        static void toCartesianRow(float *outX, float *outY, float *outZ, const float *radii, double cosLat, double sinLat,
+                                   const double *cosLons, const double *sinLons, int count, const CartesianTransform &transform);
         void close();
 };
+
+// builds averaged overviews of a DEM into an .ovr file next to it, halving the resolution until a level fits in a block or two.
+// Returns 1 on failure
+int build_overviews(std::string filename);
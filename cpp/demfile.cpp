@@ -0,0 +1,206 @@
+#include "demfile.h"
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "gdal_priv.h"
+
+static const uint32_t demFileTileSize = 256;
+static const uint64_t demFileAlignment = 4096;
+
+MappedDEMFile::MappedDEMFile() {
+    this->mapping = NULL;
+    this->mappingSize = 0;
+    this->tilesAcross = 0;
+    this->sampleSize = 0;
+    memset(&this->header, 0, sizeof(this->header));
+}
+
+MappedDEMFile::~MappedDEMFile() {
+    this->close();
+}
+
+bool MappedDEMFile::isDemFile(std::string filename) {
+    std::ifstream file(filename, std::ios::binary);
+    char magic[sizeof(demFileMagic)];
+    if (!file.read(magic, sizeof(magic))) {
+        return false;
+    }
+    return memcmp(magic, demFileMagic, sizeof(magic)) == 0;
+}
+
+int MappedDEMFile::open(std::string filename) {
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        std::cout << "Failed to open " << filename << std::endl;
+        return 1;
+    }
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) != 0 || (size_t)fileStat.st_size < sizeof(DemFileHeader)) {
+        std::cout << filename << " is too small to be a DEM file" << std::endl;
+        ::close(fd);
+        return 1;
+    }
+    void *mapped = mmap(NULL, fileStat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    // the mapping keeps the file alive on its own
+    ::close(fd);
+    if (mapped == MAP_FAILED) {
+        std::cout << "Failed to map " << filename << std::endl;
+        return 1;
+    }
+    this->mapping = (const char *)mapped;
+    this->mappingSize = fileStat.st_size;
+    memcpy(&this->header, this->mapping, sizeof(DemFileHeader));
+
+    const DemFileHeader &h = this->header;
+    this->sampleSize = h.sampleType == DEM_INT16 ? sizeof(int16_t) : sizeof(float);
+    bool valid = memcmp(h.magic, demFileMagic, sizeof(demFileMagic)) == 0 && (h.sampleType == DEM_FLOAT32 || h.sampleType == DEM_INT16) &&
+                 h.tileSize > 0 && h.width > 0 && h.height > 0;
+    if (valid) {
+        this->tilesAcross = (h.width + h.tileSize - 1) / h.tileSize;
+        uint64_t tiles_down = (h.height + h.tileSize - 1) / h.tileSize;
+        uint64_t data_size = (uint64_t)this->tilesAcross * tiles_down * h.tileSize * h.tileSize * this->sampleSize;
+        valid = h.wktOffset + h.wktLength <= this->mappingSize && h.dataOffset + data_size <= this->mappingSize;
+    }
+    if (!valid) {
+        std::cout << filename << " is not a valid DEM file" << std::endl;
+        this->close();
+        return 1;
+    }
+    // samples jump around the file, so don't read ahead more than a page
+    (void)madvise(mapped, this->mappingSize, MADV_RANDOM);
+    return 0;
+}
+
+void MappedDEMFile::close() {
+    if (this->mapping != NULL) {
+        munmap((void *)this->mapping, this->mappingSize);
+    }
+    this->mapping = NULL;
+    this->mappingSize = 0;
+}
+
+std::string MappedDEMFile::projectionWkt() const {
+    return std::string(this->mapping + this->header.wktOffset, this->header.wktLength);
+}
+
+void MappedDEMFile::readWindow(float *outVals, int column, int row, int width, int height, size_t stride, float noDataValue) const {
+    int tile_size = this->header.tileSize;
+    for (int y = 0; y < height; y++) {
+        float *outRow = outVals + (size_t)y * stride;
+        int x = 0;
+        // copy the row a tile at a time, since each tile's row is contiguous
+        while (x < width) {
+            int source_column = column + x;
+            int run = std::min(width - x, tile_size - source_column % tile_size);
+            size_t index = this->pixelIndex(source_column, row + y);
+            if (this->header.sampleType == DEM_INT16) {
+                const int16_t *stored = (const int16_t *)(this->mapping + this->header.dataOffset) + index;
+                for (int i = 0; i < run; i++) {
+                    outRow[x + i] = stored[i] == INT16_MIN ? noDataValue : (float)(stored[i] * this->header.scale + this->header.offset);
+                }
+            } else {
+                memcpy(outRow + x, (const float *)(this->mapping + this->header.dataOffset) + index, run * sizeof(float));
+            }
+            x += run;
+        }
+    }
+}
+
+int convert_dem(std::string input, std::string output, bool int16) {
+    std::cout << "Converting " << input << " to " << output << std::endl;
+    GDALDataset *dataset = GDALDataset::FromHandle(GDALOpen(input.c_str(), GA_ReadOnly));
+    if (dataset == NULL) {
+        std::cout << "Failed to open " << input << std::endl;
+        return 1;
+    }
+    GDALRasterBand *band = dataset->GetRasterBand(1);
+    const char *wkt = dataset->GetProjectionRef();
+
+    DemFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, demFileMagic, sizeof(demFileMagic));
+    header.sampleType = int16 ? DEM_INT16 : DEM_FLOAT32;
+    header.tileSize = demFileTileSize;
+    header.width = dataset->GetRasterXSize();
+    header.height = dataset->GetRasterYSize();
+    dataset->GetGeoTransform(header.geoTransform);
+    // keep the same nodata value SingleDEM would have read through GDAL
+    header.noDataValue = (float)band->GetNoDataValue();
+    header.scale = 1.0;
+    header.offset = 0.0;
+    if (int16) {
+        // spread the DEM's range over every int16 value but the one that marks nodata
+        double min_max[2];
+        if (band->ComputeRasterMinMax(FALSE, min_max) != CE_None) {
+            std::cout << "Failed to find the range of " << input << std::endl;
+            GDALClose(dataset);
+            return 1;
+        }
+        header.offset = (min_max[0] + min_max[1]) / 2.0;
+        header.scale = std::max(1e-6, (min_max[1] - min_max[0]) / (2.0 * INT16_MAX));
+    }
+    header.wktOffset = sizeof(DemFileHeader);
+    header.wktLength = strlen(wkt);
+    header.dataOffset = (header.wktOffset + header.wktLength + demFileAlignment - 1) / demFileAlignment * demFileAlignment;
+
+    std::ofstream file(output, std::ios::binary);
+    if (!file.is_open()) {
+        std::cout << "Failed to open " << output << std::endl;
+        GDALClose(dataset);
+        return 1;
+    }
+    file.write((const char *)&header, sizeof(header));
+    file.write(wkt, header.wktLength);
+    std::vector<char> padding(header.dataOffset - header.wktOffset - header.wktLength, 0);
+    file.write(padding.data(), padding.size());
+
+    // read a strip of whole tile rows at a time and write its tiles out in order
+    int tile_size = header.tileSize;
+    int tiles_across = (header.width + tile_size - 1) / tile_size;
+    size_t sample_size = int16 ? sizeof(int16_t) : sizeof(float);
+    std::vector<float> strip((size_t)header.width * tile_size);
+    std::vector<char> tile((size_t)tile_size * tile_size * sample_size);
+    float noDataValue = header.noDataValue;
+    for (int first_row = 0; first_row < header.height; first_row += tile_size) {
+        int rows = std::min(tile_size, header.height - first_row);
+        if (band->RasterIO(GF_Read, 0, first_row, header.width, rows, strip.data(), header.width, rows, GDT_Float32, 0, 0) != CE_None) {
+            std::cout << "Failed to read " << input << std::endl;
+            GDALClose(dataset);
+            return 1;
+        }
+        for (int tile_x = 0; tile_x < tiles_across; tile_x++) {
+            for (int y = 0; y < tile_size; y++) {
+                for (int x = 0; x < tile_size; x++) {
+                    int column = tile_x * tile_size + x;
+                    bool inside = y < rows && column < header.width;
+                    float value = inside ? strip[(size_t)y * header.width + column] : noDataValue;
+                    size_t index = (size_t)y * tile_size + x;
+                    if (!int16) {
+                        ((float *)tile.data())[index] = value;
+                    } else if (value == noDataValue || std::isnan(value)) {
+                        ((int16_t *)tile.data())[index] = INT16_MIN;
+                    } else {
+                        double stored = round((value - header.offset) / header.scale);
+                        ((int16_t *)tile.data())[index] = (int16_t)std::min<double>(INT16_MAX, std::max<double>(-INT16_MAX, stored));
+                    }
+                }
+            }
+            file.write(tile.data(), tile.size());
+        }
+    }
+    GDALClose(dataset);
+    file.close();
+    if (!file) {
+        std::cout << "Failed to write " << output << std::endl;
+        return 1;
+    }
+    return 0;
+}
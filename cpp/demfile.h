@@ -0,0 +1,76 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// a preprocessed DEM is this header, the projection as WKT, then the raster as square tiles starting on a page boundary.
+// tiles are stored whole (edge tiles are padded with nodata) in row major order, so every pixel is a fixed offset away
+static const char demFileMagic[8] = {'M', 'S', 'D', 'E', 'M', '1', 0, 0};
+
+enum DemSampleType {
+    DEM_FLOAT32 = 0,
+    // elevation = stored * scale + offset, and INT16_MIN marks nodata
+    DEM_INT16 = 1,
+};
+
+struct DemFileHeader {
+    char magic[8];
+    uint32_t sampleType;
+    uint32_t tileSize;
+    int32_t width;
+    int32_t height;
+    double geoTransform[6];
+    // what the source called nodata, float32 tiles store it as is
+    double noDataValue;
+    double scale;
+    double offset;
+    uint64_t wktOffset;
+    uint64_t wktLength;
+    uint64_t dataOffset;
+};
+
+class MappedDEMFile {
+    // a preprocessed DEM mapped read only into memory. Reading a pixel is a load from the mapping,
+    // so sampling makes no GDAL calls, every thread shares the one mapping, and later runs start from the page cache
+    private:
+        const char *mapping;
+        size_t mappingSize;
+        DemFileHeader header;
+        int tilesAcross;
+        size_t sampleSize;
+        size_t pixelIndex(int column, int row) const {
+            size_t tile_size = this->header.tileSize;
+            size_t tile = (size_t)(row / tile_size) * this->tilesAcross + column / tile_size;
+            return tile * tile_size * tile_size + (row % tile_size) * tile_size + column % tile_size;
+        }
+    public:
+        MappedDEMFile();
+        ~MappedDEMFile();
+        MappedDEMFile(const MappedDEMFile &) = delete;
+        MappedDEMFile &operator=(const MappedDEMFile &) = delete;
+        static bool isDemFile(std::string filename);
+        // returns 1 if the file can't be mapped or isn't a valid DEM file
+        int open(std::string filename);
+        void close();
+        const DemFileHeader &info() const {
+            return this->header;
+        }
+        std::string projectionWkt() const;
+        // returns 1 if the pixel is nodata
+        int read(float *outVal, int column, int row) const {
+            const char *data = this->mapping + this->header.dataOffset;
+            size_t index = this->pixelIndex(column, row);
+            if (this->header.sampleType == DEM_INT16) {
+                int16_t stored = ((const int16_t *)data)[index];
+                *outVal = stored * this->header.scale + this->header.offset;
+                return stored == INT16_MIN;
+            }
+            *outVal = ((const float *)data)[index];
+            return *outVal == (float)this->header.noDataValue;
+        }
+        // copies a width by height window into outVals, whose rows are stride floats apart. Nodata pixels get noDataValue
+        void readWindow(float *outVals, int column, int row, int width, int height, size_t stride, float noDataValue) const;
+};
+
+// rewrites the first band of a GDAL readable DEM into a preprocessed DEM file. Returns 1 on failure
+int convert_dem(std::string input, std::string output, bool int16);
@@ -0,0 +1,107 @@
+#include <iostream>
+#include <filesystem>
+#include <cxxopts.hpp>
+#include "gdal_priv.h"
+#include "moonsurface.h"
+#include "blockcache.h"
+#include "stats.h"
+#include "workpool.h"
+#include "texture.h"
+#include "demfile.h"
+#include "batch.h"
+#include "sun.h"
+#include "cli.h"
+
+using namespace std;
+
+int main(int argc, char *argv[]) {
+    GDALAllRegister();
+
+    cxxopts::Options options = build_options();
+    cxxopts::ParseResult result = options.parse(argc, argv);
+    if (result.count("help")) {
+        std::cout << options.help() << std::endl;
+        return 0;
+    }
+
+    if (result["convert-dem"].as<bool>()) {
+        if (!argument_exists("dem-path", options, result)) return 1;
+        for (std::string demPath : result["dem-path"].as<std::vector<std::string>>()) {
+            std::string converted = std::filesystem::path(demPath).replace_extension(".msdem").string();
+            if (convert_dem(demPath, converted, result["convert-int16"].as<bool>())) return 1;
+        }
+        return 0;
+    }
+    if (result["build-overviews"].as<bool>()) {
+        if (!argument_exists("dem-path", options, result)) return 1;
+        for (std::string demPath : result["dem-path"].as<std::vector<std::string>>()) {
+            if (build_overviews(demPath)) return 1;
+        }
+        return 0;
+    }
+    // sun directions only need the mesh's center when the mesh is rotated flat
+    if (result.count("sun-ephemeris")) {
+        if (!argument_exists("sun-start", options, result)) return 1;
+        std::string start = result["sun-start"].as<std::string>();
+        std::string end = result.count("sun-end") ? result["sun-end"].as<std::string>() : start;
+        bool rotate_flat = result["rotate-flat"].as<bool>();
+        float center_lat = 0;
+        float center_lon = 0;
+        if (rotate_flat) {
+            if (!argument_exists("centerlat", options, result) || !argument_exists("centerlon", options, result)) return 1;
+            center_lat = result["centerlat"].as<double>();
+            center_lon = result["centerlon"].as<double>();
+        }
+        return write_sun_directions(result["sun-ephemeris"].as<std::string>(), start, end, result["sun-fps"].as<double>(), rotate_flat,
+                                    center_lat, center_lon, result["output"].as<std::string>() + "_sun.csv");
+    }
+    BlockCache::defaultCapacityBytes = (size_t)result["block-cache-mb"].as<int>() * 1024 * 1024;
+
+    // batches and the socket server open the DEMs and threads once and share them between their jobs
+    if (result.count("batch") || result.count("listen")) {
+        if (!argument_exists("dem-path", options, result)) return 1;
+        std::vector<std::string> demPaths = result["dem-path"].as<std::vector<std::string>>();
+        WorkPool pool(result["threads"].as<int>());
+        PhaseTimer openTimer("open_dems");
+        DEMManager demManager = DEMManager(demPaths);
+        openTimer.stop();
+        if (!demManager.isOpen()) {
+            demManager.close();
+            return 1;
+        }
+        int jobs = result["batch-jobs"].as<int>();
+        if (jobs > 1) {
+            RunStats::markConcurrentJobs();
+        }
+        int status;
+        if (result.count("batch")) {
+            status = run_batch(result["batch"].as<std::string>(), jobs, demPaths, &pool, &demManager);
+        } else {
+            status = run_job_server(result["listen"].as<std::string>(), jobs, demPaths, &pool, &demManager);
+        }
+        demManager.close();
+        print_block_cache_stats();
+        if (result.count("stats-json")) {
+            if (RunStats::writeReport(result["stats-json"].as<std::string>())) return 1;
+        }
+        return status;
+    }
+
+    MoonSurfaceOptions meshOptions;
+    if (read_mesh_options(options, result, &meshOptions)) return 1;
+    if (!argument_exists("dem-path", options, result)) return 1;
+    meshOptions.dem_paths = result["dem-path"].as<std::vector<std::string>>();
+
+    WorkPool pool(meshOptions.threads);
+
+    if (!meshOptions.texture_path.empty()) {
+        if (create_texture(meshOptions, &pool)) return 1;
+    }
+
+    int status = create_mesh(meshOptions, &pool);
+    if (result.count("stats-json")) {
+        if (RunStats::writeReport(result["stats-json"].as<std::string>())) return 1;
+    }
+    return status;
+    
+}
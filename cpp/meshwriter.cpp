@@ -0,0 +1,300 @@
+#include "meshwriter.h"
+#include <charconv>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include "stats.h"
+
+// records are formatted in chunks of this many, and at most a few chunks per worker are held in memory at once
+static const uint64_t recordsPerChunk = 1 << 16;
+static const size_t chunksPerWorker = 4;
+
+// floats are written with the shortest representation that reads back as the same float
+// shortest round trip text where the standard library has floating point to_chars. Older libraries, like Apple's
+// libc++ before macOS 13.3, only have the integer overloads, so they get 9 significant digits, which still round trips
+static char *format_float(char *p, float value) {
+#if defined(__cpp_lib_to_chars) && __cpp_lib_to_chars >= 201611L
+    return std::to_chars(p, p + 32, value).ptr;
+#else
+    return p + snprintf(p, 32, "%.9g", value);
+#endif
+}
+
+static char *format_index(char *p, int64_t value) {
+    return std::to_chars(p, p + 24, value).ptr;
+}
+
+// writes "index/index", the vertex and uv index of a face corner
+static char *format_corner(char *p, int64_t index) {
+    *p++ = ' ';
+    p = format_index(p, index);
+    *p++ = '/';
+    return format_index(p, index);
+}
+
+MeshWriter::MeshWriter(std::string filename, WorkPool *pool) {
+    this->filename = filename;
+    this->file.open(filename, std::ios::out | std::ios::binary);
+    if (!this->file.is_open()) {
+        std::cout << "Failed to open " << filename << std::endl;
+    }
+    this->pool = pool;
+    this->chunks.resize(pool != NULL ? pool->size() * chunksPerWorker : 1);
+    this->bytesWritten = 0;
+    this->started = std::chrono::steady_clock::now();
+    this->layout = MeshLayout{0, 0, 4, 0, 0, ""};
+}
+
+bool MeshWriter::isOpen() {
+    return this->file.is_open();
+}
+
+void MeshWriter::writeString(const std::string &data) {
+    this->file.write(data.data(), data.size());
+    this->bytesWritten += data.size();
+}
+
+// formats count records in parallel. formatRecord writes record number idx at the pointer it's given,
+// using at most maxRecordLength bytes, and returns the end of what it wrote
+void MeshWriter::writeRecords(uint64_t count, size_t maxRecordLength, std::function<char *(char *, uint64_t)> formatRecord) {
+    uint64_t chunk_count = (count + recordsPerChunk - 1) / recordsPerChunk;
+    for (uint64_t first_chunk = 0; first_chunk < chunk_count; first_chunk += this->chunks.size()) {
+        size_t round_chunks = std::min<uint64_t>(this->chunks.size(), chunk_count - first_chunk);
+        auto format_chunk = [&](size_t chunk_idx, int worker) {
+            (void)worker;
+            uint64_t first_record = (first_chunk + chunk_idx) * recordsPerChunk;
+            uint64_t last_record = std::min(count, first_record + recordsPerChunk);
+            std::string &chunk = this->chunks[chunk_idx];
+            chunk.resize((last_record - first_record) * maxRecordLength);
+            char *start = &chunk[0];
+            char *p = start;
+            for (uint64_t record = first_record; record < last_record; record++) {
+                p = formatRecord(p, record);
+            }
+            chunk.resize(p - start);
+        };
+        if (this->pool != NULL) {
+            this->pool->run(round_chunks, format_chunk);
+        } else {
+            format_chunk(0, 0);
+        }
+        for (size_t chunk_idx = 0; chunk_idx < round_chunks; chunk_idx++) {
+            this->writeString(this->chunks[chunk_idx]);
+        }
+    }
+}
+
+uint64_t MeshWriter::totalBytes() {
+    return this->bytesWritten;
+}
+
+// closes the file and optionally reports how fast it was written. Returns 1 if any of it couldn't be written
+int MeshWriter::close(bool report) {
+    this->file.close();
+    if (!this->file) {
+        std::cout << "Failed to write " << this->filename << std::endl;
+        return 1;
+    }
+    RunStats::add(STAT_BYTES_WRITTEN, this->bytesWritten);
+    if (!report) {
+        return 0;
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - this->started).count();
+    double megabytes = this->bytesWritten / (1024.0 * 1024.0);
+    std::cout << "Wrote " << megabytes << " MB in " << seconds << " s";
+    if (seconds > 0) {
+        std::cout << " (" << megabytes / seconds << " MB/s)";
+    }
+    std::cout << std::endl;
+    return 0;
+}
+
+std::unique_ptr<MeshWriter> open_mesh_writer(std::string format, std::string filename, WorkPool *pool) {
+    if (format == "obj") {
+        return std::unique_ptr<MeshWriter>(new ObjWriter(filename, pool));
+    }
+    if (format == "ply") {
+        return std::unique_ptr<MeshWriter>(new PlyWriter(filename, pool));
+    }
+    return NULL;
+}
+
+ObjWriter::ObjWriter(std::string filename, WorkPool *pool) : MeshWriter(filename, pool) {
+}
+
+void ObjWriter::begin(const MeshLayout &layout) {
+    this->layout = layout;
+    if (!layout.material.empty()) {
+        this->writeLine("mtllib " + layout.material + ".mtl");
+        this->writeLine("usemtl Moon");
+    }
+}
+
+void ObjWriter::writeLine(std::string line) {
+    this->writeString(line + "\n");
+}
+
+void ObjWriter::writeVertices(const std::array<float, 3> *vertices, const std::array<float, 2> *uvs, uint64_t count) {
+    this->writeRecords(count, 64, [vertices](char *p, uint64_t idx) {
+        *p++ = 'v';
+        for (int axis = 0; axis < 3; axis++) {
+            *p++ = ' ';
+            p = format_float(p, vertices[idx][axis]);
+        }
+        *p++ = '\n';
+        return p;
+    });
+    this->writeRecords(count, 64, [uvs](char *p, uint64_t idx) {
+        *p++ = 'v';
+        *p++ = 't';
+        *p++ = ' ';
+        p = format_float(p, uvs[idx][0]);
+        *p++ = ' ';
+        p = format_float(p, uvs[idx][1]);
+        *p++ = '\n';
+        return p;
+    });
+}
+
+void ObjWriter::writeVertices(const float *x, const float *y, const float *z, uint64_t count) {
+    this->writeRecords(count, 64, [x, y, z](char *p, uint64_t idx) {
+        *p++ = 'v';
+        *p++ = ' ';
+        p = format_float(p, x[idx]);
+        *p++ = ' ';
+        p = format_float(p, y[idx]);
+        *p++ = ' ';
+        p = format_float(p, z[idx]);
+        *p++ = '\n';
+        return p;
+    });
+}
+
+// a grid's uvs follow from its place in the layout, so they go after its streamed vertices like any other mesh's
+void ObjWriter::writeGridFaces(int width, int height) {
+    if (this->layout.gridWidth > 0) {
+        int grid_width = this->layout.gridWidth;
+        int grid_height = this->layout.gridHeight;
+        this->writeRecords((uint64_t)grid_width * grid_height, 64, [grid_width, grid_height](char *p, uint64_t idx) {
+            float lat_idx = idx / grid_width;
+            float lon_idx = idx % grid_width;
+            *p++ = 'v';
+            *p++ = 't';
+            *p++ = ' ';
+            p = format_float(p, lon_idx / (grid_width - 1));
+            *p++ = ' ';
+            p = format_float(p, lat_idx / (grid_height - 1));
+            *p++ = '\n';
+            return p;
+        });
+    }
+    uint64_t faces_width = width - 1;
+    this->writeRecords(faces_width * (height - 1), 192, [width, faces_width](char *p, uint64_t idx) {
+        // OBJ indices are 1-indexed
+        int64_t coord_idx = (idx / faces_width) * width + idx % faces_width + 1;
+        *p++ = 'f';
+        p = format_corner(p, coord_idx);
+        p = format_corner(p, coord_idx + 1);
+        p = format_corner(p, coord_idx + width + 1);
+        p = format_corner(p, coord_idx + width);
+        *p++ = '\n';
+        return p;
+    });
+}
+
+void ObjWriter::writeTriangles(const std::array<uint32_t, 3> *triangles, uint64_t count) {
+    this->writeRecords(count, 128, [triangles](char *p, uint64_t idx) {
+        *p++ = 'f';
+        for (int corner = 0; corner < 3; corner++) {
+            // OBJ indices are 1-indexed
+            p = format_corner(p, (int64_t)triangles[idx][corner] + 1);
+        }
+        *p++ = '\n';
+        return p;
+    });
+}
+
+
+PlyWriter::PlyWriter(std::string filename, WorkPool *pool) : MeshWriter(filename, pool) {
+    this->verticesWritten = 0;
+}
+
+// records are copied out in the machine's byte order, which is little endian on everything this builds for
+void PlyWriter::begin(const MeshLayout &layout) {
+    this->layout = layout;
+    std::string header = "ply\nformat binary_little_endian 1.0\ncomment generated by MoonSurface\n";
+    if (!layout.material.empty()) {
+        header += "comment TextureFile " + layout.material + ".TIF\n";
+    }
+    header += "element vertex " + std::to_string(layout.vertexCount) + "\n";
+    header += "property float x\nproperty float y\nproperty float z\nproperty float s\nproperty float t\n";
+    header += "element face " + std::to_string(layout.faceCount) + "\n";
+    header += "property list uchar uint vertex_indices\n";
+    header += "end_header\n";
+    this->writeString(header);
+}
+
+void PlyWriter::writeVertices(const float *x, const float *y, const float *z, uint64_t count) {
+    uint64_t first_vertex = this->verticesWritten;
+    int width = this->layout.gridWidth;
+    int height = this->layout.gridHeight;
+    this->writeRecords(count, 5 * sizeof(float), [x, y, z, first_vertex, width, height](char *p, uint64_t idx) {
+        uint64_t grid_idx = first_vertex + idx;
+        float lat_idx = grid_idx / width;
+        float lon_idx = grid_idx % width;
+        float record[5] = {x[idx], y[idx], z[idx], lon_idx / (width - 1), lat_idx / (height - 1)};
+        memcpy(p, record, sizeof(record));
+        return p + sizeof(record);
+    });
+    this->verticesWritten += count;
+}
+
+void PlyWriter::writeVertices(const std::array<float, 3> *vertices, const std::array<float, 2> *uvs, uint64_t count) {
+    this->writeRecords(count, 5 * sizeof(float), [vertices, uvs](char *p, uint64_t idx) {
+        float record[5] = {vertices[idx][0], vertices[idx][1], vertices[idx][2], uvs[idx][0], uvs[idx][1]};
+        memcpy(p, record, sizeof(record));
+        return p + sizeof(record);
+    });
+    this->verticesWritten += count;
+}
+
+char *PlyWriter::formatCorners(char *p, const int64_t *corners, int count) {
+    *p++ = (char)count;
+    for (int corner = 0; corner < count; corner++) {
+        uint32_t index = corners[corner];
+        memcpy(p, &index, sizeof(index));
+        p += sizeof(index);
+    }
+    return p;
+}
+
+void PlyWriter::writeGridFaces(int width, int height) {
+    uint64_t faces_width = width - 1;
+    uint64_t quads = faces_width * (height - 1);
+    // counter clockwise like the OBJ quads, and split along the diagonal from each quad's first corner
+    if (this->layout.cornersPerFace == 3) {
+        this->writeRecords(quads * 2, 1 + 3 * sizeof(uint32_t), [this, width, faces_width](char *p, uint64_t idx) {
+            uint64_t quad = idx / 2;
+            int64_t coord_idx = (quad / faces_width) * width + quad % faces_width;
+            int64_t corners[3] = {coord_idx, coord_idx + 1, coord_idx + width + 1};
+            if (idx % 2 == 1) {
+                corners[1] = coord_idx + width + 1;
+                corners[2] = coord_idx + width;
+            }
+            return this->formatCorners(p, corners, 3);
+        });
+        return;
+    }
+    this->writeRecords(quads, 1 + 4 * sizeof(uint32_t), [this, width, faces_width](char *p, uint64_t idx) {
+        int64_t coord_idx = (idx / faces_width) * width + idx % faces_width;
+        int64_t corners[4] = {coord_idx, coord_idx + 1, coord_idx + width + 1, coord_idx + width};
+        return this->formatCorners(p, corners, 4);
+    });
+}
+
+void PlyWriter::writeTriangles(const std::array<uint32_t, 3> *triangles, uint64_t count) {
+    this->writeRecords(count, 1 + 3 * sizeof(uint32_t), [this, triangles](char *p, uint64_t idx) {
+        int64_t corners[3] = {triangles[idx][0], triangles[idx][1], triangles[idx][2]};
+        return this->formatCorners(p, corners, 3);
+    });
+}
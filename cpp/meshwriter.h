@@ -0,0 +1,92 @@
+#pragma once
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include "workpool.h"
+
+// what a mesh file will hold. Binary formats need the counts in their header before any of the mesh is written
+struct MeshLayout {
+    uint64_t vertexCount;
+    uint64_t faceCount;
+    // formats that keep every face the same size give grid faces this many corners, 3 splits each quad in two.
+    // OBJ mixes quads and triangles freely, so it keeps the grid's quads
+    int cornersPerFace;
+    // set when the vertices are a width by height grid streamed in row major order through the x y z writeVertices,
+    // so their uvs follow from their place in the grid. 0 when every vertex is written with its own uv
+    int gridWidth;
+    int gridHeight;
+    // title of the material and texture files the mesh refers to, empty for none
+    std::string material;
+};
+
+class MeshWriter {
+    // writes mesh files by formatting blocks of records in parallel on the work pool,
+    // then writing the formatted chunks in order with a few large writes.
+    // without a pool, records are formatted on the calling thread, so a writer can be used from inside a pool task
+    protected:
+        std::string filename;
+        std::ofstream file;
+        WorkPool *pool;
+        std::vector<std::string> chunks;
+        uint64_t bytesWritten;
+        std::chrono::steady_clock::time_point started;
+        MeshLayout layout;
+        void writeString(const std::string &data);
+        void writeRecords(uint64_t count, size_t maxRecordLength, std::function<char *(char *, uint64_t)> formatRecord);
+    public:
+        MeshWriter(std::string filename, WorkPool *pool);
+        virtual ~MeshWriter() {}
+        bool isOpen();
+        // starts the file, before anything else is written
+        virtual void begin(const MeshLayout &layout) = 0;
+        // the next vertices of the grid described by the layout
+        virtual void writeVertices(const float *x, const float *y, const float *z, uint64_t count) = 0;
+        // the vertices of an irregular mesh, each with its uv
+        virtual void writeVertices(const std::array<float, 3> *vertices, const std::array<float, 2> *uvs, uint64_t count) = 0;
+        // quads of a regular width by height grid of vertices, as create_mesh lays them out
+        virtual void writeGridFaces(int width, int height) = 0;
+        // triangles with 0-indexed vertices
+        virtual void writeTriangles(const std::array<uint32_t, 3> *triangles, uint64_t count) = 0;
+        // returns 1 if the file couldn't be written
+        int close(bool report = true);
+        uint64_t totalBytes();
+};
+
+class ObjWriter : public MeshWriter {
+    // ASCII OBJ, with floats in their shortest exact form
+    public:
+        ObjWriter(std::string filename, WorkPool *pool);
+        void begin(const MeshLayout &layout) override;
+        void writeLine(std::string line);
+        void writeVertices(const float *x, const float *y, const float *z, uint64_t count) override;
+        void writeVertices(const std::array<float, 3> *vertices, const std::array<float, 2> *uvs, uint64_t count) override;
+        void writeGridFaces(int width, int height) override;
+        void writeTriangles(const std::array<uint32_t, 3> *triangles, uint64_t count) override;
+};
+
+// PLY has no 64 bit integer type, so its vertex indices are 32 bit
+static const uint64_t plyMaxVertices = (uint64_t)UINT32_MAX + 1;
+
+class PlyWriter : public MeshWriter {
+    // binary little endian PLY. Each vertex is x y z s t as floats, and each face a uchar corner count followed by
+    // uint indices, so a PLY mesh holds at most plyMaxVertices vertices. Every record has a fixed size,
+    // so a reader can map the vertex and face elements straight into typed arrays
+    private:
+        uint64_t verticesWritten;
+        char *formatCorners(char *p, const int64_t *corners, int count);
+    public:
+        PlyWriter(std::string filename, WorkPool *pool);
+        void begin(const MeshLayout &layout) override;
+        void writeVertices(const float *x, const float *y, const float *z, uint64_t count) override;
+        void writeVertices(const std::array<float, 3> *vertices, const std::array<float, 2> *uvs, uint64_t count) override;
+        void writeGridFaces(int width, int height) override;
+        void writeTriangles(const std::array<uint32_t, 3> *triangles, uint64_t count) override;
+};
+
+// opens a writer for a --format, "obj" or "ply". Returns NULL for any other format
+std::unique_ptr<MeshWriter> open_mesh_writer(std::string format, std::string filename, WorkPool *pool);
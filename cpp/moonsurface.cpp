@@ -1,89 +1,280 @@
 #include <iostream>
 #include <fstream>
-#include <cxxopts.hpp>
 #include <pthread.h>
 #include "gdal_priv.h"
 #include "moonsurface.h"
 #include "dem.h"
+#include "blockcache.h"
+#include "stats.h"
+#include "workpool.h"
+#include "meshwriter.h"
+#include "adaptivemesh.h"
+#include "pyramid.h"
 
 using namespace std;
-void *work_thread(void *state) {
-    BagOfState *bag = (BagOfState *) state;
-    DEMManager demManager = DEMManager(bag->options->dem_paths);
-
-    float center_elevation = demManager.sample(bag->options->latlon[0], bag->options->latlon[1]);
-    for (int coord_idx = bag->thread_idx; coord_idx < bag->vertices_height * bag->vertices_width; coord_idx += bag->thread_count) {
-        int lat_idx = coord_idx / bag->vertices_width;
-        int lon_idx = coord_idx % bag->vertices_width;
-        float lat = bag->options->min_latlon[0] + lat_idx / bag->options->verts_per_degree;
-        float lon = bag->options->min_latlon[1] + lon_idx / bag->options->verts_per_degree;
-        if (bag->options->rotate_flat) {
-            demManager.getCartesian(&(*bag->vertices)[coord_idx], lat, lon, bag->options->latlon[0], bag->options->latlon[1], center_elevation, bag->options->scale);
-        } else {
-            demManager.getCartesian(&(*bag->vertices)[coord_idx], lat, lon, bag->options->scale);
+// samples one tile of the current band. Tiles are rectangles of vertices, so each thread works on a compact patch of the DEM
+// and writes to its own part of the band
+void sample_tile(BagOfState *bag, size_t tile_idx) {
+    DEMManager *demManager = bag->demManager;
+    MeshBand *band = bag->band;
+    int first_row = (tile_idx / bag->tiles_across) * bag->tile_height;
+    int first_lon_idx = (tile_idx % bag->tiles_across) * bag->tile_width;
+    int tile_height = std::min(bag->tile_height, bag->band_rows - first_row);
+    int tile_width = std::min(bag->tile_width, bag->vertices_width - first_lon_idx);
+    const float *lons = bag->lons->data() + first_lon_idx;
+
+    // the whole tile is sampled at once, so each DEM reads one window for it
+    static thread_local std::vector<float> radii;
+    static thread_local std::vector<float> lats;
+    radii.resize((size_t)tile_width * tile_height);
+    if (bag->sampleCache != NULL) {
+        for (int row = 0; row < tile_height; row++) {
+            bag->sampleCache->sampleRow(radii.data() + (size_t)row * tile_width, bag->origin_row + bag->band_first_row + first_row + row,
+                                        bag->origin_column + first_lon_idx, tile_width);
+        }
+    } else {
+        lats.resize(tile_height);
+        for (int row = 0; row < tile_height; row++) {
+            lats[row] = bag->options->min_latlon[0] + (bag->band_first_row + first_row + row) / bag->options->verts_per_degree;
         }
+        demManager->sampleGrid(radii.data(), lats.data(), tile_height, lons, tile_width, 1.0 / bag->options->verts_per_degree);
+    }
+    for (int row = 0; row < tile_height; row++) {
+        int64_t lat_idx = bag->band_first_row + first_row + row;
+        size_t coord_idx = (size_t)(first_row + row) * bag->vertices_width + first_lon_idx;
+        DEMManager::toCartesianRow(band->x.data() + coord_idx, band->y.data() + coord_idx, band->z.data() + coord_idx,
+                                   radii.data() + (size_t)row * tile_width, (*bag->cos_lats)[lat_idx], (*bag->sin_lats)[lat_idx],
+                                   bag->cos_lons->data() + first_lon_idx, bag->sin_lons->data() + first_lon_idx, tile_width, bag->transform);
     }
+}
 
-    demManager.close();
-    return NULL;
+// writes the vertices of each sampled band in order while the next bands are being sampled
+void *write_thread(void *state) {
+    WriterState *writerState = (WriterState *) state;
+    BandQueue *queue = writerState->queue;
+    while (true) {
+        MeshBand *band;
+        {
+            std::unique_lock<std::mutex> lock(queue->mutex);
+            queue->changed.wait(lock, [queue] { return !queue->sampled.empty() || queue->finished; });
+            if (queue->sampled.empty()) {
+                return NULL;
+            }
+            band = queue->sampled.front();
+            queue->sampled.pop_front();
+        }
+        {
+            PhaseTimer writeTimer("write_vertices");
+            writerState->writer->writeVertices(band->x.data(), band->y.data(), band->z.data(), band->x.size());
+        }
+        {
+            std::lock_guard<std::mutex> lock(queue->mutex);
+            queue->free.push_back(band);
+        }
+        queue->changed.notify_all();
+    }
 }
 
-int create_mesh(MoonSurfaceOptions meshOptions) {
+int create_mesh(MoonSurfaceOptions meshOptions, WorkPool *pool) {
+    PhaseTimer openTimer("open_dems");
     DEMManager demManager = DEMManager(meshOptions.dem_paths);
+    openTimer.stop();
+    if (!demManager.isOpen()) {
+        demManager.close();
+        return 1;
+    }
+    int status = create_mesh(meshOptions, pool, &demManager);
+    demManager.close();
+    print_block_cache_stats();
+    return status;
+}
+
+// only call this while nothing is sampling, see BlockCache::totals
+void print_block_cache_stats() {
+    BlockCacheStats cacheStats = BlockCache::totals();
+    uint64_t cacheLookups = cacheStats.hits + cacheStats.misses;
+    std::cout << "Block cache: " << cacheStats.hits << " hits, " << cacheStats.misses << " misses, " << cacheStats.evictions << " evictions";
+    if (cacheLookups > 0) {
+        std::cout << " (" << 100.0 * cacheStats.hits / cacheLookups << "% hit rate)";
+    }
+    std::cout << std::endl;
+}
+
+// moves the mesh's corner onto the lattice of points every 1 / verts per degree degrees, which cached samples sit on,
+// and sets outOrigin to the lattice row and column of the corner. Moving a corner that's already on it changes nothing
+void snap_to_sample_lattice(MoonSurfaceOptions *meshOptions, int64_t outOrigin[2]) {
+    for (int axis = 0; axis < 2; axis++) {
+        outOrigin[axis] = SampleCache::latticeIndex(meshOptions->min_latlon[axis], meshOptions->verts_per_degree);
+        meshOptions->min_latlon[axis] = outOrigin[axis] / (double)meshOptions->verts_per_degree;
+    }
+}
+
+// opens the sample cache if the options ask for one, with the mesh's corner on its lattice
+std::unique_ptr<SampleCache> open_sample_cache(MoonSurfaceOptions *meshOptions, DEMManager *demManager, int64_t outOrigin[2]) {
+    outOrigin[0] = 0;
+    outOrigin[1] = 0;
+    if (meshOptions->sample_cache.empty()) {
+        return NULL;
+    }
+    snap_to_sample_lattice(meshOptions, outOrigin);
+    return std::unique_ptr<SampleCache>(new SampleCache(meshOptions->sample_cache, meshOptions->dem_paths, meshOptions->verts_per_degree, demManager));
+}
+
+// builds a mesh from DEMs that are already open, so several meshes can share them
+int create_mesh(MoonSurfaceOptions meshOptions, WorkPool *pool, DEMManager *demManager) {
+    if (meshOptions.pyramid_levels > 0) {
+        return create_pyramid(meshOptions, pool, demManager);
+    }
+    if (meshOptions.max_error > 0) {
+        return create_adaptive_mesh(meshOptions, pool, demManager);
+    }
     // write the dimensions of the faces in the file
     int vertices_height = floor(meshOptions.latlon_extent[0] * meshOptions.verts_per_degree) + 1;
     int vertices_width = floor(meshOptions.latlon_extent[1] * meshOptions.verts_per_degree) + 1;
 
-    std::cout << "Generating mesh" << std::endl;
-    std::vector<std::array<float, 3>> vertices(vertices_width * vertices_height);
-    pthread_t threads[meshOptions.threads];
-    BagOfState bags[meshOptions.threads];
-    for (int thread_idx = 0; thread_idx < meshOptions.threads; thread_idx++) {
-        bags[thread_idx].thread_idx = thread_idx;
-        bags[thread_idx].thread_count = meshOptions.threads;
-        bags[thread_idx].vertices_width = vertices_width;
-        bags[thread_idx].vertices_height = vertices_height;
-        bags[thread_idx].options = &meshOptions;
-        bags[thread_idx].vertices = &vertices;
-        pthread_create(&threads[thread_idx], NULL, work_thread, &bags[thread_idx]);
-    }
-    // wait for each thread to finish
-    for (int thread_idx = 0; thread_idx < meshOptions.threads; thread_idx++) {
-        pthread_join(threads[thread_idx], NULL);
-    }
+    int64_t origin[2];
+    std::unique_ptr<SampleCache> sampleCache = open_sample_cache(&meshOptions, demManager, origin);
 
     // prepare file
-    std::ofstream meshFile;
-    meshFile.open(meshOptions.output + ".obj");
-    meshFile << "mtllib " << meshOptions.output << ".mtl" << std::endl;
-    meshFile << "usemtl Moon" << std::endl;
+    std::unique_ptr<MeshWriter> meshFile = open_mesh_writer(meshOptions.format, meshOptions.output + "." + meshOptions.format, pool);
+    if (!meshFile->isOpen()) {
+        return 1;
+    }
+    uint64_t faces_width = vertices_width - 1;
+    meshFile->begin(MeshLayout{(uint64_t)vertices_width * vertices_height, faces_width * (vertices_height - 1), 4, vertices_width,
+                               vertices_height, meshOptions.output});
 
-    std::cout << "Writing vertices" << std::endl;
-    for (std::array<float, 3> vertex : vertices) {
-        meshFile << "v " << vertex[0] << " " << vertex[1] << " " << vertex[2] << std::endl;
+    // without streaming, the whole mesh is one band. With it, a band can be written while the next two are sampled
+    int band_rows = vertices_height;
+    int band_count = 1;
+    if (meshOptions.band_rows > 0 && meshOptions.band_rows < vertices_height) {
+        band_rows = meshOptions.band_rows;
+        band_count = 3;
+    }
+    std::vector<MeshBand> bands(band_count);
+    BandQueue queue;
+    queue.finished = false;
+    for (MeshBand &band : bands) {
+        queue.free.push_back(&band);
+    }
+    WriterState writerState;
+    writerState.queue = &queue;
+    writerState.writer = meshFile.get();
+    pthread_t writer;
+    pthread_create(&writer, NULL, write_thread, &writerState);
+
+    std::cout << "Generating mesh" << std::endl;
+    // the mesh is a regular grid, so every row shares the same longitudes
+    // and every vertex in a row shares the same latitude, so the trig is done once per row and once per column.
+    // angles are found in double so they don't drift across large extents
+    std::vector<float> lons(vertices_width);
+    std::vector<double> cos_lons(vertices_width);
+    std::vector<double> sin_lons(vertices_width);
+    for (int lon_idx = 0; lon_idx < vertices_width; lon_idx++) {
+        lons[lon_idx] = meshOptions.min_latlon[1] + lon_idx / meshOptions.verts_per_degree;
+        double lon_radians = ((double)meshOptions.min_latlon[1] + lon_idx / (double)meshOptions.verts_per_degree) * M_PI / 180.0;
+        cos_lons[lon_idx] = cos(lon_radians);
+        sin_lons[lon_idx] = sin(lon_radians);
+    }
+    std::vector<double> cos_lats(vertices_height);
+    std::vector<double> sin_lats(vertices_height);
+    for (int lat_idx = 0; lat_idx < vertices_height; lat_idx++) {
+        double lat_radians = ((double)meshOptions.min_latlon[0] + lat_idx / (double)meshOptions.verts_per_degree) * M_PI / 180.0;
+        cos_lats[lat_idx] = cos(lat_radians);
+        sin_lats[lat_idx] = sin(lat_radians);
     }
 
-    std::cout << "Writing uvs" << std::endl;
-    for (float lat_idx = 0; lat_idx < vertices_height; lat_idx++) {
-        for (float lon_idx = 0; lon_idx < vertices_width; lon_idx++) {
-            meshFile << "vt " << lon_idx / (vertices_width - 1) << " " << lat_idx / (vertices_height - 1) << std::endl;
+    BagOfState bag;
+    bag.vertices_width = vertices_width;
+    bag.vertices_height = vertices_height;
+    demManager->tileSize(meshOptions.verts_per_degree, &bag.tile_width, &bag.tile_height);
+    bag.tiles_across = (vertices_width + bag.tile_width - 1) / bag.tile_width;
+    // every thread samples through the same opened DEMs
+    bag.center_elevation = demManager->sample(meshOptions.latlon[0], meshOptions.latlon[1]);
+    bag.options = &meshOptions;
+    bag.demManager = demManager;
+    bag.lons = &lons;
+    bag.cos_lats = &cos_lats;
+    bag.sin_lats = &sin_lats;
+    bag.cos_lons = &cos_lons;
+    bag.sin_lons = &sin_lons;
+    if (meshOptions.rotate_flat) {
+        bag.transform = DEMManager::rotateFlatTransform(meshOptions.latlon[0], meshOptions.latlon[1], bag.center_elevation, meshOptions.scale);
+    } else {
+        bag.transform = DEMManager::scaleTransform(meshOptions.scale);
+    }
+    bag.sampleCache = sampleCache.get();
+    bag.origin_row = origin[0];
+    bag.origin_column = origin[1];
+    for (int64_t first_row = 0; first_row < vertices_height; first_row += band_rows) {
+        MeshBand *band;
+        {
+            std::unique_lock<std::mutex> lock(queue.mutex);
+            queue.changed.wait(lock, [&queue] { return !queue.free.empty(); });
+            band = queue.free.back();
+            queue.free.pop_back();
+        }
+        band->first_row = first_row;
+        band->rows = std::min<int64_t>(band_rows, vertices_height - first_row);
+        band->x.resize((size_t)band->rows * vertices_width);
+        band->y.resize((size_t)band->rows * vertices_width);
+        band->z.resize((size_t)band->rows * vertices_width);
+
+        bag.band_first_row = band->first_row;
+        bag.band_rows = band->rows;
+        bag.band = band;
+        int tiles_down = (band->rows + bag.tile_height - 1) / bag.tile_height;
+        PhaseTimer sampleTimer("sample");
+        if (sampleCache) {
+            sampleCache->fill(pool, origin[0] + band->first_row, origin[1], band->rows, vertices_width);
+        }
+        pool->run((size_t)bag.tiles_across * tiles_down, [&bag](size_t tile_idx, int worker) {
+            (void)worker;
+            sample_tile(&bag, tile_idx);
+        });
+        sampleTimer.stop();
+        if (sampleCache) {
+            sampleCache->releaseRowsBefore(origin[0] + band->first_row + band->rows);
         }
+
+        {
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            queue.sampled.push_back(band);
+        }
+        queue.changed.notify_all();
+    }
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.finished = true;
     }
-    
+    queue.changed.notify_all();
+    {
+        // whatever the writer still has queued once sampling is done
+        PhaseTimer drainTimer("drain_writer");
+        pthread_join(writer, NULL);
+    }
+    bands.clear();
+
+    PhaseTimer facesTimer("write_faces");
     std::cout << "Writing faces" << std::endl;
-    for (int lat_idx = 0; lat_idx < vertices_height - 1; lat_idx++) {
-        for (int lon_idx = 0; lon_idx < vertices_width - 1; lon_idx++) {
-            // OBJ indices are 1-indexed
-            int coord_idx = lat_idx * vertices_width + lon_idx + 1;
-            meshFile << "f " << coord_idx << "/" << coord_idx;
-            meshFile << " " << coord_idx + 1 << "/" << coord_idx + 1;
-            meshFile << " " << coord_idx + vertices_width + 1 << "/" << coord_idx + vertices_width + 1;
-            meshFile << " " << coord_idx + vertices_width << "/" << coord_idx + vertices_width << std::endl;;
-        }
+    meshFile->writeGridFaces(vertices_width, vertices_height);
+
+    int status = meshFile->close();
+    facesTimer.stop();
+    if (status) {
+        return status;
     }
-    
-    meshFile.close();
 
+    write_mtl(meshOptions);
+    std::cout << "Done" << std::endl;
+    return 0;
+}
+
+// PLY names its texture in a header comment instead, so only OBJ meshes get a material file
+int write_mtl(MoonSurfaceOptions meshOptions) {
+    if (meshOptions.format != "obj") {
+        return 0;
+    }
     std::cout << "Writing .mtl file" << std::endl;
     std::ofstream mtlFile;
     mtlFile.open(meshOptions.output + ".mtl");
@@ -94,106 +285,5 @@ int create_mesh(MoonSurfaceOptions meshOptions) {
     mtlFile << "Ks 0.000 0.000 0.000" << std::endl;
     mtlFile << "map_Kd " << meshOptions.output << ".TIF" << std::endl;
     mtlFile.close();
-
-    std::cout << "Done" << std::endl;
-    return 0;
-}
-
-int create_texture(MoonSurfaceOptions meshOptions) {
-    std::cout << "Cropping texture" << std::endl;
-    GDALDataset *globalTexture = GDALDataset::FromHandle(GDALOpen(meshOptions.texture_path.c_str(), GA_ReadOnly));
-    GDALRasterBand *raster = globalTexture->GetRasterBand(1);
-
-    int texture_width = raster->GetXSize();
-    int texture_height = raster->GetYSize();
-
-    float min_lat_uv = meshOptions.min_latlon[0] / 180.0 + 0.5;
-    float max_lat_uv = (meshOptions.min_latlon[0] + meshOptions.latlon_extent[0]) / 180.0 + 0.5;
-    float min_lon_uv = meshOptions.min_latlon[1] / 360.0 + 0.5;
-    float max_lon_uv = (meshOptions.min_latlon[1] + meshOptions.latlon_extent[1]) / 360.0 + 0.5;
-    
-    int cropped_width = meshOptions.latlon_extent[1] / 360.0f * texture_width;
-    int cropped_height = meshOptions.latlon_extent[0] / 180.0f * texture_height;
-    
-    int min_lat_pixel = texture_height - min_lat_uv * texture_height;
-    int min_lon_pixel = min_lon_uv * texture_width;
-    float *buffer = (float *) CPLMalloc(sizeof(float) * cropped_width * cropped_height);
-    GDALDataset *croppedDataset = globalTexture->GetDriver()->Create((meshOptions.output + ".TIF").c_str(), cropped_width, cropped_height, 1, GDT_Float32, NULL);
-    GDALRasterBand *croppedRaster = croppedDataset->GetRasterBand(1);
-
-    (void)raster->RasterIO(GF_Read, min_lon_pixel, min_lat_pixel - cropped_height, cropped_width, cropped_height, buffer, cropped_width, cropped_height, GDT_Float32, 0, 0);
-    (void)croppedRaster->RasterIO(GF_Write, 0, 0, cropped_width, cropped_height, buffer, cropped_width, cropped_height, GDT_Float32, 0, 0);
-    
-
-    std::cout << "Saving texture" << std::endl;
-    croppedDataset->FlushCache();
     return 0;
 }
-
-int argument_exists(std::string flag, cxxopts::Options options, cxxopts::ParseResult result) {
-    if (result.count(flag) == 0) {
-        std::cout << "Missing argument: " << flag << std::endl;
-        std::cout << options.help() << std::endl;
-        return 0;
-    }
-    return 1;
-}
-
-int main(int argc, char *argv[]) {
-    GDALAllRegister();
-
-    cxxopts::Options options("MoonSurface", "A program to generate a moon surface");
-    options.add_options()
-        ("centerlat", "Center Latitude", cxxopts::value<double>())
-        ("centerlon", "Center Longitude", cxxopts::value<double>())
-        ("latextent", "Latitude Width", cxxopts::value<double>())
-        ("lonextent", "Longitude Height", cxxopts::value<double>())
-        ("verts-per-degree", "Vertices Per Degree", cxxopts::value<double>())
-        ("scale", "Scale", cxxopts::value<double>()->default_value("1.0"))
-        ("threads", "Number of threads", cxxopts::value<int>()->default_value("1"))
-        ("rotate-flat", "Transform mesh so the center latlon is facing z-up", cxxopts::value<bool>()->default_value("false"))
-        ("dem-path", "Path to DEM file. Can be used multiple times to load multiple DEM files.", cxxopts::value<std::vector<std::string>>())
-        ("img-path", "Path to image file.", cxxopts::value<std::string>())
-        ("output", "Output file title", cxxopts::value<std::string>()->default_value("moonmesh"))
-        ("h,help", "Print help")
-        ;
-    cxxopts::ParseResult result = options.parse(argc, argv);
-    if (result.count("help")) {
-        std::cout << options.help() << std::endl;
-        return 0;
-    }
-
-    MoonSurfaceOptions meshOptions;
-    if (!argument_exists("centerlat", options, result)) return 1;
-    meshOptions.latlon[0] = result["centerlat"].as<double>();
-
-    if (!argument_exists("centerlon", options, result)) return 1;
-    meshOptions.latlon[1] = result["centerlon"].as<double>();
-
-    if (!argument_exists("latextent", options, result)) return 1;
-    meshOptions.latlon_extent[0] = result["latextent"].as<double>();
-
-    if (!argument_exists("lonextent", options, result)) return 1;
-    meshOptions.latlon_extent[1] = result["lonextent"].as<double>();
-
-    meshOptions.min_latlon[0] = meshOptions.latlon[0] - meshOptions.latlon_extent[0] / 2.0;
-    meshOptions.min_latlon[1] = meshOptions.latlon[1] - meshOptions.latlon_extent[1] / 2.0;
-    if (!argument_exists("verts-per-degree", options, result)) return 1;
-    meshOptions.verts_per_degree = result["verts-per-degree"].as<double>();
-
-    meshOptions.scale = result["scale"].as<double>();
-    meshOptions.threads = result["threads"].as<int>();
-    meshOptions.rotate_flat = result["rotate-flat"].as<bool>();
-
-    if (!argument_exists("dem-path", options, result)) return 1;
-    meshOptions.dem_paths = result["dem-path"].as<std::vector<std::string>>();
-    meshOptions.output = result["output"].as<std::string>();
-
-    if (argument_exists("img-path", options, result)) {
-        meshOptions.texture_path = result["img-path"].as<std::string>();
-        if (create_texture(meshOptions)) return 1;
-    }
-
-    return create_mesh(meshOptions);
-    
-}
\ No newline at end of file
@@ -1,24 +1,85 @@
 #pragma once
 #include <string>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
 #include "dem.h"
+#include "meshwriter.h"
+#include "samplecache.h"
+#include "workpool.h"
 struct MoonSurfaceOptions {
     float latlon[2];
     float min_latlon[2];
     float latlon_extent[2];
     float verts_per_degree;
     float scale;
+    float max_error;
     int threads;
+    int band_rows;
+    int pyramid_levels;
     bool rotate_flat;
     std::vector<std::string> dem_paths;
     std::string output;
+    // mesh file format, obj or ply
+    std::string format;
     std::string texture_path;
+    std::string texture_compression;
+    // directory of cached samples, empty to sample everything
+    std::string sample_cache;
+};
+
+// a band of whole rows of the mesh, with the vertex coordinates kept as a structure of arrays
+struct MeshBand {
+    int64_t first_row;
+    int rows;
+    std::vector<float> x;
+    std::vector<float> y;
+    std::vector<float> z;
+};
+
+// bands go from the sampler to the writer through here. There is a fixed number of band buffers,
+// so the sampler waits for the writer once they're all in use
+struct BandQueue {
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::deque<MeshBand *> sampled;
+    std::vector<MeshBand *> free;
+    bool finished;
+};
+
+struct WriterState {
+    BandQueue *queue;
+    MeshWriter *writer;
 };
 
 struct BagOfState {
-    int thread_idx;
-    int thread_count;
     int vertices_width;
     int vertices_height;
+    int64_t band_first_row;
+    int band_rows;
+    int tile_width;
+    int tile_height;
+    int tiles_across;
+    float center_elevation;
     MoonSurfaceOptions *options;
-    std::vector<std::array<float, 3>> *vertices;
+    DEMManager *demManager;
+    std::vector<float> *lons;
+    // trig of every row's latitude and every column's longitude, computed once per mesh in double
+    std::vector<double> *cos_lats;
+    std::vector<double> *sin_lats;
+    std::vector<double> *cos_lons;
+    std::vector<double> *sin_lons;
+    CartesianTransform transform;
+    MeshBand *band;
+    // with a sample cache, radii come from it, and the mesh's first row and column are these lattice indices
+    SampleCache *sampleCache;
+    int64_t origin_row;
+    int64_t origin_column;
 };
+
+int create_mesh(MoonSurfaceOptions meshOptions, WorkPool *pool);
+int create_mesh(MoonSurfaceOptions meshOptions, WorkPool *pool, DEMManager *demManager);
+int write_mtl(MoonSurfaceOptions meshOptions);
+void snap_to_sample_lattice(MoonSurfaceOptions *meshOptions, int64_t outOrigin[2]);
+std::unique_ptr<SampleCache> open_sample_cache(MoonSurfaceOptions *meshOptions, DEMManager *demManager, int64_t outOrigin[2]);
+void print_block_cache_stats();
@@ -0,0 +1,268 @@
+#include "pyramid.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include "stats.h"
+
+// the pyramid is a quadtree of mesh tiles over the region. Level 0 is one tile at --verts-per-degree, and every
+// level below it splits each tile into four with the same number of vertices, so the vertex spacing halves.
+// tiles sit on a lattice of vertices, so neighbours on the same level share their edge vertices exactly,
+// and each tile has a skirt hanging down from its edges to hide cracks against neighbours on other levels
+
+struct PyramidTile {
+    int level;
+    int x;
+    int y;
+    double min_latlon[2];
+    double max_latlon[2];
+    float geometric_error;
+    float min_radius;
+    float max_radius;
+    std::string filename;
+};
+
+struct PyramidState {
+    MoonSurfaceOptions *options;
+    DEMManager *demManager;
+    float center_elevation;
+    CartesianTransform transform;
+    int vertices_width;
+    int vertices_height;
+    int levels;
+    std::vector<PyramidTile> *tiles;
+    // set by any tile that couldn't be written
+    std::atomic<bool> failed;
+};
+
+// tiles are stored a level at a time, each level row by row
+static size_t tile_index(int level, int x, int y) {
+    return (((size_t)1 << (2 * level)) - 1) / 3 + ((size_t)y << level) + x;
+}
+
+// returns 1 if the tile couldn't be written
+static int build_tile(PyramidState *state, PyramidTile *tile) {
+    MoonSurfaceOptions *options = state->options;
+    int width = state->vertices_width;
+    int height = state->vertices_height;
+    double level_verts_per_degree = (double)options->verts_per_degree * (1 << tile->level);
+    // every level but the finest is sampled at the density of the level below, to measure how far it is from it
+    int factor = tile->level == state->levels - 1 ? 1 : 2;
+    int sample_width = (width - 1) * factor + 1;
+    int sample_height = (height - 1) * factor + 1;
+    int64_t first_column = (int64_t)tile->x * (width - 1) * factor;
+    int64_t first_row = (int64_t)tile->y * (height - 1) * factor;
+    double sample_verts_per_degree = level_verts_per_degree * factor;
+
+    std::vector<float> lons(sample_width);
+    for (int column = 0; column < sample_width; column++) {
+        lons[column] = options->min_latlon[1] + (first_column + column) / sample_verts_per_degree;
+    }
+    std::vector<float> lats(sample_height);
+    for (int row = 0; row < sample_height; row++) {
+        lats[row] = options->min_latlon[0] + (first_row + row) / sample_verts_per_degree;
+    }
+    std::vector<float> radii((size_t)sample_width * sample_height);
+    state->demManager->sampleGrid(radii.data(), lats.data(), sample_height, lons.data(), sample_width, 1.0 / sample_verts_per_degree);
+    tile->min_latlon[0] = lats[0];
+    tile->min_latlon[1] = lons[0];
+    tile->max_latlon[0] = lats[sample_height - 1];
+    tile->max_latlon[1] = lons[sample_width - 1];
+
+    // the geometric error is how far the samples of the next level are from this tile's interpolated surface
+    tile->geometric_error = 0;
+    if (factor == 2) {
+        for (int row = 0; row < sample_height; row++) {
+            for (int column = 0; column < sample_width; column++) {
+                if (row % 2 == 0 && column % 2 == 0) {
+                    continue;
+                }
+                int row_0 = row - row % 2;
+                int row_1 = row_0 + 2 * (row % 2);
+                int column_0 = column - column % 2;
+                int column_1 = column_0 + 2 * (column % 2);
+                float interpolated = (radii[(size_t)row_0 * sample_width + column_0] + radii[(size_t)row_0 * sample_width + column_1]
+                                    + radii[(size_t)row_1 * sample_width + column_0] + radii[(size_t)row_1 * sample_width + column_1]) / 4;
+                float error = fabs(radii[(size_t)row * sample_width + column] - interpolated);
+                tile->geometric_error = std::max(tile->geometric_error, error);
+            }
+        }
+        // a tile is never closer to the finest surface than its children are, so renderers can refine until the
+        // error is small enough. The level below is already built
+        for (int child = 0; child < 4; child++) {
+            const PyramidTile &below = (*state->tiles)[tile_index(tile->level + 1, tile->x * 2 + child % 2, tile->y * 2 + child / 2)];
+            tile->geometric_error = std::max(tile->geometric_error, below.geometric_error);
+        }
+    }
+
+    // the tile's own vertices are every factor-th sample
+    std::vector<std::array<float, 3>> vertices;
+    std::vector<std::array<float, 2>> uvs;
+    std::vector<float> tile_radii;
+    tile->min_radius = INFINITY;
+    tile->max_radius = -INFINITY;
+    double tiles_across = 1 << tile->level;
+    for (int row = 0; row < height; row++) {
+        for (int column = 0; column < width; column++) {
+            size_t sample_idx = (size_t)row * factor * sample_width + column * factor;
+            tile_radii.push_back(radii[sample_idx]);
+            tile->min_radius = std::min(tile->min_radius, radii[sample_idx]);
+            tile->max_radius = std::max(tile->max_radius, radii[sample_idx]);
+            // uvs span the whole region, so every tile shares the region's texture
+            uvs.push_back({(float)((tile->x * (width - 1) + column) / (tiles_across * (width - 1))),
+                           (float)((tile->y * (height - 1) + row) / (tiles_across * (height - 1)))});
+        }
+    }
+
+    // the skirt follows the edge of the tile counter clockwise, hanging one geometric error (at least a metre) below it.
+    // the error already covers every finer level, so the skirt is deep enough to hide cracks against any of them
+    std::vector<int> perimeter;
+    for (int column = 0; column < width - 1; column++) {
+        perimeter.push_back(column);
+    }
+    for (int row = 0; row < height - 1; row++) {
+        perimeter.push_back(row * width + width - 1);
+    }
+    for (int column = width - 1; column > 0; column--) {
+        perimeter.push_back((height - 1) * width + column);
+    }
+    for (int row = height - 1; row > 0; row--) {
+        perimeter.push_back(row * width);
+    }
+    float skirt_depth = std::max(tile->geometric_error, 1.0f);
+    std::vector<float> vertex_radii = tile_radii;
+    std::vector<int> vertex_grid(tile_radii.size());
+    for (size_t idx = 0; idx < vertex_grid.size(); idx++) {
+        vertex_grid[idx] = idx;
+    }
+    for (int grid_idx : perimeter) {
+        vertex_radii.push_back(tile_radii[grid_idx] - skirt_depth);
+        vertex_grid.push_back(grid_idx);
+        uvs.push_back(uvs[grid_idx]);
+    }
+    std::vector<std::array<uint32_t, 3>> skirt_faces;
+    uint32_t skirt_start = tile_radii.size();
+    for (size_t edge = 0; edge < perimeter.size(); edge++) {
+        size_t next = (edge + 1) % perimeter.size();
+        skirt_faces.push_back({(uint32_t)perimeter[edge], skirt_start + (uint32_t)edge, skirt_start + (uint32_t)next});
+        skirt_faces.push_back({(uint32_t)perimeter[edge], skirt_start + (uint32_t)next, (uint32_t)perimeter[next]});
+    }
+
+    for (size_t idx = 0; idx < vertex_radii.size(); idx++) {
+        int grid_idx = vertex_grid[idx];
+        float lat = lats[(grid_idx / width) * factor];
+        float lon = lons[(grid_idx % width) * factor];
+        std::array<float, 3> vertex;
+        DEMManager::toCartesian(&vertex, vertex_radii[idx], lat, lon, state->transform);
+        vertices.push_back(vertex);
+    }
+
+    // tiles are already built in parallel, so each one is written from its own task
+    // the skirt is triangles, so formats with one face size split the grid's quads to match
+    std::unique_ptr<MeshWriter> meshFile = open_mesh_writer(options->format, tile->filename, NULL);
+    if (!meshFile->isOpen()) {
+        return 1;
+    }
+    uint64_t grid_triangles = (uint64_t)(width - 1) * (height - 1) * 2;
+    meshFile->begin(MeshLayout{vertices.size(), grid_triangles + skirt_faces.size(), 3, 0, 0, options->output});
+    meshFile->writeVertices(vertices.data(), uvs.data(), vertices.size());
+    meshFile->writeGridFaces(width, height);
+    meshFile->writeTriangles(skirt_faces.data(), skirt_faces.size());
+    return meshFile->close(false);
+}
+
+// returns 1 if the index couldn't be written
+static int write_pyramid_index(MoonSurfaceOptions meshOptions, std::vector<PyramidTile> &tiles, int levels) {
+    std::string filename = meshOptions.output + "_pyramid.json";
+    std::ofstream indexFile;
+    indexFile.open(filename);
+    if (!indexFile.is_open()) {
+        std::cout << "Failed to open " << filename << std::endl;
+        return 1;
+    }
+    indexFile << std::setprecision(10);
+    indexFile << "{" << std::endl;
+    indexFile << "  \"levels\": " << levels << "," << std::endl;
+    if (meshOptions.format == "obj") {
+        indexFile << "  \"material\": " << json_string(meshOptions.output + ".mtl") << "," << std::endl;
+    }
+    indexFile << "  \"tiles\": [" << std::endl;
+    for (size_t tile_idx = 0; tile_idx < tiles.size(); tile_idx++) {
+        PyramidTile &tile = tiles[tile_idx];
+        indexFile << "    {\"level\": " << tile.level << ", \"x\": " << tile.x << ", \"y\": " << tile.y
+                  << ", \"file\": " << json_string(tile.filename)
+                  << ", \"min_lat\": " << tile.min_latlon[0] << ", \"max_lat\": " << tile.max_latlon[0]
+                  << ", \"min_lon\": " << tile.min_latlon[1] << ", \"max_lon\": " << tile.max_latlon[1]
+                  << ", \"min_radius\": " << tile.min_radius << ", \"max_radius\": " << tile.max_radius
+                  << ", \"geometric_error\": " << tile.geometric_error << "}";
+        indexFile << (tile_idx + 1 < tiles.size() ? "," : "") << std::endl;
+    }
+    indexFile << "  ]" << std::endl;
+    indexFile << "}" << std::endl;
+    indexFile.close();
+    if (!indexFile) {
+        std::cout << "Failed to write " << filename << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+int create_pyramid(MoonSurfaceOptions meshOptions, WorkPool *pool, DEMManager *demManager) {
+    int levels = meshOptions.pyramid_levels;
+
+    std::vector<PyramidTile> tiles;
+    PyramidState state;
+    state.options = &meshOptions;
+    state.demManager = demManager;
+    state.center_elevation = demManager->sample(meshOptions.latlon[0], meshOptions.latlon[1]);
+    if (meshOptions.rotate_flat) {
+        state.transform = DEMManager::rotateFlatTransform(meshOptions.latlon[0], meshOptions.latlon[1], state.center_elevation, meshOptions.scale);
+    } else {
+        state.transform = DEMManager::scaleTransform(meshOptions.scale);
+    }
+    state.vertices_height = floor(meshOptions.latlon_extent[0] * meshOptions.verts_per_degree) + 1;
+    state.vertices_width = floor(meshOptions.latlon_extent[1] * meshOptions.verts_per_degree) + 1;
+    state.levels = levels;
+    state.tiles = &tiles;
+    state.failed = false;
+
+    for (int level = 0; level < levels; level++) {
+        for (int y = 0; y < (1 << level); y++) {
+            for (int x = 0; x < (1 << level); x++) {
+                PyramidTile tile;
+                tile.level = level;
+                tile.x = x;
+                tile.y = y;
+                tile.filename = meshOptions.output + "_" + std::to_string(level) + "_" + std::to_string(x) + "_" + std::to_string(y) + "." + meshOptions.format;
+                tiles.push_back(tile);
+            }
+        }
+    }
+    std::cout << "Generating " << tiles.size() << " tiles over " << levels << " levels" << std::endl;
+    // levels are built from the finest up, so every tile's children are done before its error takes theirs in.
+    // each tile is sampled and written by the same task, so the two share one phase
+    PhaseTimer tileTimer("sample_and_write_tiles");
+    for (int level = levels - 1; level >= 0; level--) {
+        size_t first_tile = tile_index(level, 0, 0);
+        pool->run((size_t)1 << (2 * level), [&state, &tiles, first_tile](size_t tile_idx, int worker) {
+            (void)worker;
+            if (build_tile(&state, &tiles[first_tile + tile_idx])) {
+                state.failed = true;
+            }
+        });
+    }
+    tileTimer.stop();
+    if (state.failed) {
+        return 1;
+    }
+
+    std::cout << "Writing pyramid index" << std::endl;
+    if (write_pyramid_index(meshOptions, tiles, levels)) {
+        return 1;
+    }
+    write_mtl(meshOptions);
+    std::cout << "Done" << std::endl;
+    return 0;
+}
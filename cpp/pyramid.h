@@ -0,0 +1,5 @@
+#pragma once
+#include "moonsurface.h"
+#include "workpool.h"
+
+int create_pyramid(MoonSurfaceOptions meshOptions, WorkPool *pool, DEMManager *demManager);
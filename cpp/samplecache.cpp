@@ -0,0 +1,165 @@
+#include "samplecache.h"
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <unistd.h>
+#include "stats.h"
+
+// a tile file is this magic followed by tileSize * tileSize float radii, row by row
+static const char sampleTileMagic[8] = {'M', 'S', 'T', 'I', 'L', 'E', '1', 0};
+
+// FNV-1a, which is plenty to tell DEM sets apart
+static uint64_t hash_string(const std::string &text) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (unsigned char c : text) {
+        hash = (hash ^ c) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+SampleCache::SampleCache(std::string directory, const std::vector<std::string> &demPaths, double vertsPerDegree, DEMManager *demManager) {
+    this->vertsPerDegree = vertsPerDegree;
+    this->demManager = demManager;
+    std::ostringstream key;
+    key.precision(17);
+    key << "tile " << tileSize << " verts per degree " << vertsPerDegree;
+    // overviews change what's sampled without touching the DEM, so their files are part of the key too
+    std::vector<std::string> keyPaths;
+    for (const std::string &demPath : demPaths) {
+        keyPaths.push_back(demPath);
+        keyPaths.push_back(demPath + ".ovr");
+    }
+    for (const std::string &keyPath : keyPaths) {
+        std::error_code error;
+        std::filesystem::path path = std::filesystem::absolute(keyPath, error);
+        uintmax_t size = std::filesystem::file_size(path, error);
+        int64_t modified = std::filesystem::last_write_time(path, error).time_since_epoch().count();
+        key << "\n" << path.string() << " " << (error ? 0 : size) << " " << (error ? 0 : modified);
+    }
+    char name[17];
+    snprintf(name, sizeof(name), "%016llx", (unsigned long long)hash_string(key.str()));
+    this->directory = (std::filesystem::path(directory) / name).string();
+    std::error_code error;
+    std::filesystem::create_directories(this->directory, error);
+    if (error) {
+        std::cout << "Failed to create the sample cache " << this->directory << ", samples won't be saved" << std::endl;
+    }
+}
+
+int64_t SampleCache::latticeIndex(double degrees, double vertsPerDegree) {
+    return llround(degrees * vertsPerDegree);
+}
+
+std::string SampleCache::tilePath(int64_t tileRow, int64_t tileColumn) {
+    return this->directory + "/" + std::to_string(tileRow) + "_" + std::to_string(tileColumn) + ".tile";
+}
+
+// finds the tile, reading it from disk or sampling and saving it the first time any thread asks for it
+SampleCache::Tile *SampleCache::tile(int64_t tileRow, int64_t tileColumn) {
+    Tile *found;
+    {
+        std::lock_guard<std::mutex> lock(this->tilesMutex);
+        std::unique_ptr<Tile> &entry = this->tiles[{tileRow, tileColumn}];
+        if (!entry) {
+            entry.reset(new Tile());
+            entry->ready = false;
+        }
+        found = entry.get();
+    }
+    std::lock_guard<std::mutex> lock(found->mutex);
+    if (found->ready) {
+        return found;
+    }
+    size_t count = (size_t)tileSize * tileSize;
+    found->radii.resize(count);
+    std::string path = this->tilePath(tileRow, tileColumn);
+    std::ifstream cached(path, std::ios::binary);
+    char magic[sizeof(sampleTileMagic)];
+    if (cached.read(magic, sizeof(magic)) && memcmp(magic, sampleTileMagic, sizeof(magic)) == 0 &&
+        cached.read((char *)found->radii.data(), count * sizeof(float))) {
+        RunStats::add(STAT_SAMPLE_CACHE_HITS, 1);
+        found->ready = true;
+        return found;
+    }
+
+    RunStats::add(STAT_SAMPLE_CACHE_MISSES, 1);
+    std::vector<float> lats(tileSize);
+    std::vector<float> lons(tileSize);
+    for (int idx = 0; idx < tileSize; idx++) {
+        lats[idx] = (tileRow * tileSize + idx) / this->vertsPerDegree;
+        lons[idx] = (tileColumn * tileSize + idx) / this->vertsPerDegree;
+    }
+    int read_failed = this->demManager->sampleGrid(found->radii.data(), lats.data(), tileSize, lons.data(), tileSize, 1.0 / this->vertsPerDegree);
+    found->ready = true;
+    // samples missing because a DEM couldn't be read serve this run, but shouldn't outlive it
+    if (read_failed) {
+        return found;
+    }
+
+    // write somewhere private and rename it into place, so other runs never see half a tile
+    std::ostringstream temporary;
+    temporary << path << "." << getpid() << "." << std::hash<std::thread::id>()(std::this_thread::get_id()) << ".tmp";
+    std::ofstream file(temporary.str(), std::ios::binary);
+    file.write(sampleTileMagic, sizeof(sampleTileMagic));
+    file.write((const char *)found->radii.data(), count * sizeof(float));
+    file.close();
+    std::error_code error;
+    if (file) {
+        std::filesystem::rename(temporary.str(), path, error);
+        RunStats::add(STAT_BYTES_WRITTEN, sizeof(sampleTileMagic) + count * sizeof(float));
+    }
+    if (!file || error) {
+        std::filesystem::remove(temporary.str(), error);
+    }
+    return found;
+}
+
+// floor division, since rows and columns south and west of 0 are negative
+int64_t SampleCache::tileIndex(int64_t latticeIndex) {
+    return latticeIndex >= 0 ? latticeIndex / tileSize : -((-latticeIndex - 1) / tileSize) - 1;
+}
+
+void SampleCache::fill(WorkPool *pool, int64_t row, int64_t column, int64_t rows, int64_t columns) {
+    if (rows <= 0 || columns <= 0) {
+        return;
+    }
+    int64_t first_tile_row = tileIndex(row);
+    int64_t first_tile_column = tileIndex(column);
+    int64_t tiles_down = tileIndex(row + rows - 1) - first_tile_row + 1;
+    int64_t tiles_across = tileIndex(column + columns - 1) - first_tile_column + 1;
+    pool->run(tiles_down * tiles_across, [this, first_tile_row, first_tile_column, tiles_across](size_t tile_idx, int worker) {
+        (void)worker;
+        this->tile(first_tile_row + tile_idx / tiles_across, first_tile_column + tile_idx % tiles_across);
+    });
+}
+
+void SampleCache::sampleRow(float *outRadii, int64_t row, int64_t column, int count) {
+    int64_t tile_row = tileIndex(row);
+    int64_t row_in_tile = row - tile_row * tileSize;
+    int done = 0;
+    while (done < count) {
+        int64_t lattice_column = column + done;
+        int64_t tile_column = tileIndex(lattice_column);
+        int64_t column_in_tile = lattice_column - tile_column * tileSize;
+        int run = std::min<int64_t>(count - done, tileSize - column_in_tile);
+        Tile *cached = this->tile(tile_row, tile_column);
+        memcpy(outRadii + done, cached->radii.data() + row_in_tile * tileSize + column_in_tile, run * sizeof(float));
+        done += run;
+    }
+}
+
+void SampleCache::releaseRowsBefore(int64_t row) {
+    std::lock_guard<std::mutex> lock(this->tilesMutex);
+    for (auto entry = this->tiles.begin(); entry != this->tiles.end();) {
+        if ((entry->first.first + 1) * tileSize <= row) {
+            entry = this->tiles.erase(entry);
+        } else {
+            ++entry;
+        }
+    }
+}
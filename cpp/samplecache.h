@@ -0,0 +1,47 @@
+#pragma once
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+#include "dem.h"
+#include "workpool.h"
+
+class SampleCache {
+    // radii sampled on the lattice of points every 1 / verts per degree degrees, kept on disk in square tiles so a run over
+    // a region that overlaps an earlier one only samples the tiles no earlier run has. The tiles live in a directory named
+    // after a hash of the DEM and overview paths, sizes and modification times and the vertex density, so changing any of
+    // them starts afresh.
+    // radii are planet centered, so a cached tile serves any scale or rotate flat.
+    // a single SampleCache is safe to share between threads
+    private:
+        struct Tile {
+            // held while the tile is read from disk or sampled
+            std::mutex mutex;
+            bool ready;
+            std::vector<float> radii;
+        };
+        std::string directory;
+        double vertsPerDegree;
+        DEMManager *demManager;
+        std::mutex tilesMutex;
+        std::map<std::pair<int64_t, int64_t>, std::unique_ptr<Tile>> tiles;
+        Tile *tile(int64_t tileRow, int64_t tileColumn);
+        static int64_t tileIndex(int64_t latticeIndex);
+        std::string tilePath(int64_t tileRow, int64_t tileColumn);
+    public:
+        static const int tileSize = 256;
+        SampleCache(std::string directory, const std::vector<std::string> &demPaths, double vertsPerDegree, DEMManager *demManager);
+        // the nearest lattice row or column to a latitude or longitude
+        static int64_t latticeIndex(double degrees, double vertsPerDegree);
+        // loads or samples every tile under a block of the lattice, one pool task per tile. Meshes call this before
+        // sampling rows, so a missing tile is sampled by one worker instead of blocking every worker that reaches it
+        void fill(WorkPool *pool, int64_t row, int64_t column, int64_t rows, int64_t columns);
+        // fills outRadii with count radii along a lattice row, starting at a lattice column
+        void sampleRow(float *outRadii, int64_t row, int64_t column, int count);
+        // forgets the tiles that end above a lattice row, once a streamed mesh is past them.
+        // only call this while nothing is sampling from the cache
+        void releaseRowsBefore(int64_t row);
+};
@@ -0,0 +1,235 @@
+#include "stats.h"
+#include "blockcache.h"
+#include <atomic>
+#include <cstdio>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <set>
+#include <sys/resource.h>
+
+static const char *counterNames[STAT_COUNTER_COUNT] = {
+    "samples",
+    "unserved_samples",
+    "nodata_misses",
+    "raster_io_calls",
+    "transform_calls",
+    "transformed_points",
+    "bytes_written",
+    "sample_cache_hits",
+    "sample_cache_misses",
+};
+
+// counters of threads that are still running, and the sums of those whose threads have already exited
+static std::mutex registryMutex;
+static std::set<const RunStats *> liveStats;
+static uint64_t retiredCounters[STAT_COUNTER_COUNT] = {};
+static std::vector<uint64_t> retiredServedBy;
+static std::map<int, std::string> sourceNames;
+
+struct Phase {
+    std::string name;
+    double wallSeconds;
+    double cpuSeconds;
+    uint64_t count;
+};
+// phases in the order they first started
+static std::mutex phaseMutex;
+static std::vector<Phase> phases;
+static const std::chrono::steady_clock::time_point runStarted = std::chrono::steady_clock::now();
+static std::atomic<bool> concurrentJobs(false);
+
+static double process_cpu_seconds() {
+    timespec now;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+static void add_served(std::vector<uint64_t> *total, const std::vector<uint64_t> &served) {
+    if (total->size() < served.size()) {
+        total->resize(served.size(), 0);
+    }
+    for (size_t source = 0; source < served.size(); source++) {
+        (*total)[source] += served[source];
+    }
+}
+
+RunStats::RunStats() {
+    for (int counter = 0; counter < STAT_COUNTER_COUNT; counter++) {
+        this->counters[counter] = 0;
+    }
+    std::lock_guard<std::mutex> lock(registryMutex);
+    liveStats.insert(this);
+}
+
+RunStats::~RunStats() {
+    std::lock_guard<std::mutex> lock(registryMutex);
+    liveStats.erase(this);
+    for (int counter = 0; counter < STAT_COUNTER_COUNT; counter++) {
+        retiredCounters[counter] += this->counters[counter];
+    }
+    add_served(&retiredServedBy, this->servedBy);
+}
+
+RunStats &RunStats::local() {
+    static thread_local RunStats stats;
+    return stats;
+}
+
+void RunStats::served(int source, uint64_t amount) {
+    RunStats &stats = RunStats::local();
+    if ((size_t)source >= stats.servedBy.size()) {
+        stats.servedBy.resize(source + 1, 0);
+    }
+    stats.servedBy[source] += amount;
+}
+
+void RunStats::markConcurrentJobs() {
+    concurrentJobs = true;
+}
+
+void RunStats::nameSource(int source, std::string name) {
+    std::lock_guard<std::mutex> lock(registryMutex);
+    sourceNames[source] = name;
+}
+
+PhaseTimer::PhaseTimer(std::string name) {
+    this->name = name;
+    this->wallStart = std::chrono::steady_clock::now();
+    this->cpuStart = process_cpu_seconds();
+    this->running = true;
+}
+
+PhaseTimer::~PhaseTimer() {
+    this->stop();
+}
+
+void PhaseTimer::stop() {
+    if (!this->running) {
+        return;
+    }
+    this->running = false;
+    double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - this->wallStart).count();
+    double cpu = process_cpu_seconds() - this->cpuStart;
+    std::lock_guard<std::mutex> lock(phaseMutex);
+    for (Phase &phase : phases) {
+        if (phase.name == this->name) {
+            phase.wallSeconds += wall;
+            phase.cpuSeconds += cpu;
+            phase.count++;
+            return;
+        }
+    }
+    phases.push_back(Phase{this->name, wall, cpu, 1});
+}
+
+// ru_maxrss is in kilobytes on Linux but in bytes on macOS
+static uint64_t peak_rss_bytes() {
+    rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
+    }
+#ifdef __APPLE__
+    return (uint64_t)usage.ru_maxrss;
+#else
+    return (uint64_t)usage.ru_maxrss * 1024;
+#endif
+}
+
+// JSON strings only need quotes, backslashes and control characters escaped
+std::string json_string(const std::string &text) {
+    std::string escaped = "\"";
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            escaped += '\\';
+            escaped += c;
+        } else if ((unsigned char)c < 0x20) {
+            char code[8];
+            snprintf(code, sizeof(code), "\\u%04x", c);
+            escaped += code;
+        } else {
+            escaped += c;
+        }
+    }
+    return escaped + "\"";
+}
+
+static void write_counters(std::ofstream &file, const uint64_t *counters, const char *indent) {
+    file << "{";
+    for (int counter = 0; counter < STAT_COUNTER_COUNT; counter++) {
+        file << (counter ? ",\n" : "\n") << indent << "  \"" << counterNames[counter] << "\": " << counters[counter];
+    }
+    file << "\n" << indent << "}";
+}
+
+int RunStats::writeReport(std::string filename) {
+    std::ofstream file(filename);
+    if (!file.is_open()) {
+        std::cout << "Failed to open " << filename << std::endl;
+        return 1;
+    }
+    double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - runStarted).count();
+    file << "{\n";
+    file << "  \"wall_seconds\": " << wall << ",\n";
+    file << "  \"cpu_seconds\": " << process_cpu_seconds() << ",\n";
+    file << "  \"peak_rss_bytes\": " << peak_rss_bytes() << ",\n";
+    // counters and phases of concurrent jobs are mixed together, so the whole report is for the batch
+    file << "  \"concurrent_jobs\": " << (concurrentJobs ? "true" : "false") << ",\n";
+
+    file << "  \"phases\": [";
+    {
+        std::lock_guard<std::mutex> lock(phaseMutex);
+        for (size_t phase_idx = 0; phase_idx < phases.size(); phase_idx++) {
+            const Phase &phase = phases[phase_idx];
+            file << (phase_idx ? ",\n" : "\n") << "    {\"name\": " << json_string(phase.name);
+            if (!concurrentJobs) {
+                file << ", \"wall_seconds\": " << phase.wallSeconds;
+            }
+            file << ", \"cpu_seconds\": " << phase.cpuSeconds << ", \"count\": " << phase.count << "}";
+        }
+    }
+    file << "\n  ],\n";
+
+    // totals over every thread, then each running thread on its own to show how evenly work was spread
+    std::lock_guard<std::mutex> lock(registryMutex);
+    uint64_t totals[STAT_COUNTER_COUNT];
+    std::vector<uint64_t> servedBy = retiredServedBy;
+    for (int counter = 0; counter < STAT_COUNTER_COUNT; counter++) {
+        totals[counter] = retiredCounters[counter];
+    }
+    for (const RunStats *stats : liveStats) {
+        for (int counter = 0; counter < STAT_COUNTER_COUNT; counter++) {
+            totals[counter] += stats->counters[counter];
+        }
+        add_served(&servedBy, stats->servedBy);
+    }
+    file << "  \"bytes_written\": " << totals[STAT_BYTES_WRITTEN] << ",\n";
+    file << "  \"counters\": ";
+    write_counters(file, totals, "  ");
+    file << ",\n  \"threads\": [";
+    bool first = true;
+    for (const RunStats *stats : liveStats) {
+        file << (first ? "\n    " : ",\n    ");
+        write_counters(file, stats->counters, "    ");
+        first = false;
+    }
+    file << "\n  ],\n";
+
+    file << "  \"dems\": [";
+    first = true;
+    for (const std::pair<const int, std::string> &source : sourceNames) {
+        uint64_t served = (size_t)source.first < servedBy.size() ? servedBy[source.first] : 0;
+        file << (first ? "\n" : ",\n") << "    {\"path\": " << json_string(source.second) << ", \"samples_served\": " << served << "}";
+        first = false;
+    }
+    file << "\n  ],\n";
+
+    BlockCacheStats cacheStats = BlockCache::totals();
+    file << "  \"block_cache\": {\"hits\": " << cacheStats.hits << ", \"misses\": " << cacheStats.misses
+         << ", \"evictions\": " << cacheStats.evictions << "}\n";
+    file << "}\n";
+    file.close();
+    return 0;
+}
@@ -0,0 +1,67 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+enum StatCounter {
+    // points asked of a DEMManager, and those that no DEM had data for
+    STAT_SAMPLES,
+    STAT_UNSERVED,
+    // points that fell inside a DEM but touched a nodata pixel
+    STAT_NODATA_MISSES,
+    STAT_RASTER_IO_CALLS,
+    // calls into PROJ and the points they transformed. Linear DEMs skip PROJ and aren't counted
+    STAT_TRANSFORM_CALLS,
+    STAT_TRANSFORMED_POINTS,
+    STAT_BYTES_WRITTEN,
+    // tiles of the sample cache read from disk, and those that had to be sampled
+    STAT_SAMPLE_CACHE_HITS,
+    STAT_SAMPLE_CACHE_MISSES,
+    STAT_COUNTER_COUNT
+};
+
+class RunStats {
+    // per thread counters for the hot paths. Like BlockCache, every thread owns its own counters,
+    // so counting never takes a lock, and they are only merged when the report is written
+    private:
+        uint64_t counters[STAT_COUNTER_COUNT];
+        // samples each DEM served, indexed by the DEM's source id
+        std::vector<uint64_t> servedBy;
+        RunStats();
+    public:
+        ~RunStats();
+        RunStats(const RunStats &) = delete;
+        RunStats &operator=(const RunStats &) = delete;
+        static RunStats &local();
+        static void add(StatCounter counter, uint64_t amount) {
+            RunStats::local().counters[counter] += amount;
+        }
+        static void served(int source, uint64_t amount);
+        // names a DEM source id in the report
+        static void nameSource(int source, std::string name);
+        // batches that build several jobs at once run the same phases concurrently, so their summed wall times would
+        // overlap. After this the report leaves phase wall times out, and says it covers the whole batch
+        static void markConcurrentJobs();
+        // writes the merged counters, phase times, block cache stats and peak memory as JSON.
+        // like BlockCache::totals, only call it while no other thread is counting
+        static int writeReport(std::string filename);
+};
+
+class PhaseTimer {
+    // adds the wall clock and process CPU time between construction and stop() (or destruction) to a named phase of the run.
+    // timing the same phase again, e.g. once per band, adds to its total. CPU time covers every thread in the process,
+    // so phases that overlap (sampling one band while writing another) share it
+    private:
+        std::string name;
+        std::chrono::steady_clock::time_point wallStart;
+        double cpuStart;
+        bool running;
+    public:
+        PhaseTimer(std::string name);
+        ~PhaseTimer();
+        void stop();
+};
+
+// text as a quoted JSON string, escaped where it needs to be
+std::string json_string(const std::string &text);
@@ -0,0 +1,344 @@
+#include "sun.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "dem.h"
+
+// DAF files are made of 1024 byte records. The first one describes the file, and the segment summaries
+// are kept in a linked list of records starting at the one it names
+static const size_t dafRecordSize = 1024;
+// unix time of 2000-01-01 12:00:00, the J2000 epoch if it were on the UTC scale
+static const double unixJ2000 = 946728000.0;
+
+SpkFile::SpkFile() {
+    this->mapping = NULL;
+    this->mappingSize = 0;
+}
+
+SpkFile::~SpkFile() {
+    this->close();
+}
+
+int SpkFile::open(std::string filename) {
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        std::cout << "Failed to open " << filename << std::endl;
+        return 1;
+    }
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) != 0 || (size_t)fileStat.st_size < dafRecordSize) {
+        std::cout << filename << " is too small to be an SPK file" << std::endl;
+        ::close(fd);
+        return 1;
+    }
+    void *mapped = mmap(NULL, fileStat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (mapped == MAP_FAILED) {
+        std::cout << "Failed to map " << filename << std::endl;
+        return 1;
+    }
+    this->mapping = (const char *)mapped;
+    this->mappingSize = fileStat.st_size;
+
+    int32_t double_count, int_count, first_summary;
+    memcpy(&double_count, this->mapping + 8, sizeof(int32_t));
+    memcpy(&int_count, this->mapping + 12, sizeof(int32_t));
+    memcpy(&first_summary, this->mapping + 76, sizeof(int32_t));
+    if (memcmp(this->mapping, "DAF/SPK ", 8) != 0 || memcmp(this->mapping + 88, "LTL-IEEE", 8) != 0 || double_count != 2 || int_count != 6) {
+        std::cout << filename << " is not a little endian SPK file" << std::endl;
+        this->close();
+        return 1;
+    }
+
+    // each summary is the start and end epochs, then target, center, frame, type and the segment's first and last address
+    size_t summary_size = double_count + (int_count + 1) / 2;
+    size_t records_left = this->mappingSize / dafRecordSize;
+    this->segments.clear();
+    for (int32_t record = first_summary; record > 0 && records_left > 0; records_left--) {
+        size_t offset = (size_t)(record - 1) * dafRecordSize;
+        if (offset + dafRecordSize > this->mappingSize) {
+            break;
+        }
+        const double *control = (const double *)(this->mapping + offset);
+        int summary_count = std::min<int>(control[2], (dafRecordSize / sizeof(double) - 3) / summary_size);
+        for (int summary_idx = 0; summary_idx < summary_count; summary_idx++) {
+            const double *summary = control + 3 + summary_idx * summary_size;
+            int32_t ints[6];
+            memcpy(ints, summary + double_count, sizeof(ints));
+            SpkSegment segment = {summary[0], summary[1], ints[0], ints[1], ints[3], ints[4], ints[5]};
+            bool chebyshev = segment.type == 2 || segment.type == 3;
+            if (chebyshev && segment.startAddress > 0 && segment.endAddress - segment.startAddress >= 4 &&
+                (size_t)segment.endAddress * sizeof(double) <= this->mappingSize) {
+                this->segments.push_back(segment);
+            }
+        }
+        record = (int32_t)control[0];
+    }
+    // positions jump between a few segments, so don't read ahead more than a page
+    (void)madvise(mapped, this->mappingSize, MADV_RANDOM);
+    return 0;
+}
+
+void SpkFile::close() {
+    if (this->mapping != NULL) {
+        munmap((void *)this->mapping, this->mappingSize);
+    }
+    this->mapping = NULL;
+    this->mappingSize = 0;
+    this->segments.clear();
+}
+
+// later segments take precedence over earlier ones, as in every SPK reader
+const SpkSegment *SpkFile::findSegment(int target, double epoch) const {
+    for (size_t idx = this->segments.size(); idx-- > 0;) {
+        const SpkSegment &segment = this->segments[idx];
+        if (segment.target == target && epoch >= segment.startEpoch && epoch <= segment.endEpoch) {
+            return &segment;
+        }
+    }
+    return NULL;
+}
+
+// a segment ends with the epoch its records start at, the time each covers, the size of a record and their count.
+// each record is its midpoint and half width in seconds, then the Chebyshev coefficients of x, y and z
+// (type 3 follows them with the velocity's, which aren't needed here)
+void SpkFile::segmentPosition(double outPosition[3], const SpkSegment &segment, double epoch) const {
+    const double *trailer = this->words() + segment.endAddress - 4;
+    double first_epoch = trailer[0];
+    double interval = trailer[1];
+    int record_size = trailer[2];
+    int64_t record_count = trailer[3];
+    int64_t record = floor((epoch - first_epoch) / interval);
+    record = std::max<int64_t>(0, std::min(record, record_count - 1));
+    const double *coefficients = this->words() + segment.startAddress - 1 + record * record_size;
+    int terms = (record_size - 2) / (segment.type == 2 ? 3 : 6);
+    double tau = (epoch - coefficients[0]) / coefficients[1];
+    for (int axis = 0; axis < 3; axis++) {
+        // Clenshaw's recurrence sums the series without evaluating each polynomial
+        const double *c = coefficients + 2 + axis * terms;
+        double b1 = 0, b2 = 0;
+        for (int k = terms - 1; k >= 1; k--) {
+            double b0 = 2 * tau * b1 - b2 + c[k];
+            b2 = b1;
+            b1 = b0;
+        }
+        outPosition[axis] = c[0] + tau * b1 - b2;
+    }
+}
+
+// follows the chain of segments from the body to the solar system barycenter, e.g. Moon -> Earth-Moon barycenter -> SSB
+int SpkFile::barycentricPosition(double outPosition[3], int body, double epoch) const {
+    outPosition[0] = outPosition[1] = outPosition[2] = 0;
+    for (int links = 0; body != NAIF_SOLAR_SYSTEM_BARYCENTER; links++) {
+        const SpkSegment *segment = this->findSegment(body, epoch);
+        if (segment == NULL || links > 16) {
+            return 1;
+        }
+        double relative[3];
+        this->segmentPosition(relative, *segment, epoch);
+        for (int axis = 0; axis < 3; axis++) {
+            outPosition[axis] += relative[axis];
+        }
+        body = segment->center;
+    }
+    return 0;
+}
+
+int SpkFile::position(double outPosition[3], int target, int center, double epoch) const {
+    double target_position[3], center_position[3];
+    if (this->barycentricPosition(target_position, target, epoch) || this->barycentricPosition(center_position, center, epoch)) {
+        return 1;
+    }
+    for (int axis = 0; axis < 3; axis++) {
+        outPosition[axis] = target_position[axis] - center_position[axis];
+    }
+    return 0;
+}
+
+// days from 1970-01-01 to a date in the proleptic Gregorian calendar
+static int64_t days_from_civil(int64_t year, int month, int day) {
+    year -= month <= 2;
+    int64_t era = (year >= 0 ? year : year - 399) / 400;
+    int64_t year_of_era = year - era * 400;
+    int64_t day_of_year = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+    int64_t day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+    return era * 146097 + day_of_era - 719468;
+}
+
+static void civil_from_days(int64_t days, int *year, int *month, int *day) {
+    days += 719468;
+    int64_t era = (days >= 0 ? days : days - 146096) / 146097;
+    int64_t day_of_era = days - era * 146097;
+    int64_t year_of_era = (day_of_era - day_of_era / 1460 + day_of_era / 36524 - day_of_era / 146096) / 365;
+    int64_t day_of_year = day_of_era - (365 * year_of_era + year_of_era / 4 - year_of_era / 100);
+    int64_t shifted_month = (5 * day_of_year + 2) / 153;
+    *day = day_of_year - (153 * shifted_month + 2) / 5 + 1;
+    *month = shifted_month < 10 ? shifted_month + 3 : shifted_month - 9;
+    *year = year_of_era + era * 400 + (*month <= 2);
+}
+
+static int parse_utc(std::string text, double *outUnixSeconds) {
+    int year, month, day, hour, minute;
+    double second;
+    if (sscanf(text.c_str(), "%d-%d-%d%*[ T]%d:%d:%lf", &year, &month, &day, &hour, &minute, &second) != 6 || month < 1 || month > 12 ||
+        day < 1 || day > 31 || hour < 0 || hour > 23 || minute < 0 || minute > 59 || second < 0 || second >= 61) {
+        return 1;
+    }
+    *outUnixSeconds = days_from_civil(year, month, day) * 86400.0 + hour * 3600.0 + minute * 60.0 + second;
+    return 0;
+}
+
+static std::string format_utc(double unixSeconds) {
+    int64_t days = floor(unixSeconds / 86400.0);
+    double seconds_of_day = unixSeconds - days * 86400.0;
+    int year, month, day;
+    civil_from_days(days, &year, &month, &day);
+    int hour = seconds_of_day / 3600;
+    int minute = (seconds_of_day - hour * 3600) / 60;
+    char text[32];
+    snprintf(text, sizeof(text), "%04d-%02d-%02d %02d:%02d:%06.3f", year, month, day, hour, minute, seconds_of_day - hour * 3600 - minute * 60);
+    return text;
+}
+
+// TDB seconds past J2000 at a UTC time. TT is UTC plus the leap seconds so far plus 32.184 s,
+// and TDB stays within 2 ms of TT, which is far below anything a light can show
+static double utc_to_epoch(double unixSeconds) {
+    static const int leapSeconds[][3] = {
+        {1972, 1, 10}, {1972, 7, 11}, {1973, 1, 12}, {1974, 1, 13}, {1975, 1, 14}, {1976, 1, 15}, {1977, 1, 16},
+        {1978, 1, 17}, {1979, 1, 18}, {1980, 1, 19}, {1981, 7, 20}, {1982, 7, 21}, {1983, 7, 22}, {1985, 7, 23},
+        {1988, 1, 24}, {1990, 1, 25}, {1991, 1, 26}, {1992, 7, 27}, {1993, 7, 28}, {1994, 7, 29}, {1996, 1, 30},
+        {1997, 7, 31}, {1999, 1, 32}, {2006, 1, 33}, {2009, 1, 34}, {2012, 7, 35}, {2015, 7, 36}, {2017, 1, 37},
+    };
+    // before 1972 UTC wasn't kept in whole seconds from TAI, so the first offset is close enough
+    int tai_minus_utc = leapSeconds[0][2];
+    for (const int *leap : leapSeconds) {
+        if (unixSeconds >= days_from_civil(leap[0], leap[1], 1) * 86400.0) {
+            tai_minus_utc = leap[2];
+        }
+    }
+    return unixSeconds + tai_minus_utc + 32.184 - unixJ2000;
+}
+
+int parse_utc_epoch(std::string text, double *outEpoch) {
+    double unix_seconds;
+    if (parse_utc(text, &unix_seconds)) {
+        return 1;
+    }
+    *outEpoch = utc_to_epoch(unix_seconds);
+    return 0;
+}
+
+// the pole and prime meridian of the Moon from Archinal et al. 2011, accurate to about 150 m at the surface
+void moon_orientation(double outMatrix[3][3], double epoch) {
+    double d = epoch / 86400.0;
+    double t = d / 36525.0;
+    const double degrees = M_PI / 180.0;
+    double e[14];
+    static const double rates[14][2] = {
+        {0, 0}, {125.045, -0.0529921}, {250.089, -0.1059842}, {260.008, 13.0120009}, {176.625, 13.3407154},
+        {357.529, 0.9856003}, {311.589, 26.4057084}, {134.963, 13.0649930}, {276.617, 0.3287146},
+        {34.226, 1.7484877}, {15.134, -0.1589763}, {119.743, 0.0036096}, {239.961, 0.1643573}, {25.053, 12.9590088},
+    };
+    for (int term = 1; term < 14; term++) {
+        e[term] = (rates[term][0] + rates[term][1] * d) * degrees;
+    }
+    double right_ascension = 269.9949 + 0.0031 * t - 3.8787 * sin(e[1]) - 0.1204 * sin(e[2]) + 0.0700 * sin(e[3]) - 0.0172 * sin(e[4])
+                             + 0.0072 * sin(e[6]) - 0.0052 * sin(e[10]) + 0.0043 * sin(e[13]);
+    double declination = 66.5392 + 0.0130 * t + 1.5419 * cos(e[1]) + 0.0239 * cos(e[2]) - 0.0278 * cos(e[3]) + 0.0068 * cos(e[4])
+                         - 0.0029 * cos(e[6]) + 0.0009 * cos(e[7]) + 0.0008 * cos(e[10]) - 0.0009 * cos(e[13]);
+    double meridian = 38.3213 + 13.17635815 * d - 1.4e-12 * d * d + 3.5610 * sin(e[1]) + 0.1208 * sin(e[2]) - 0.0642 * sin(e[3])
+                      + 0.0158 * sin(e[4]) + 0.0252 * sin(e[5]) - 0.0066 * sin(e[6]) - 0.0047 * sin(e[7]) - 0.0046 * sin(e[8])
+                      + 0.0028 * sin(e[9]) + 0.0052 * sin(e[10]) + 0.0040 * sin(e[11]) + 0.0019 * sin(e[12]) - 0.0044 * sin(e[13]);
+
+    // rotate about z to the node, about x to the pole, then about z to the prime meridian
+    double angles[3] = {(90.0 + right_ascension) * degrees, (90.0 - declination) * degrees, fmod(meridian, 360.0) * degrees};
+    double node[3][3] = {{cos(angles[0]), sin(angles[0]), 0}, {-sin(angles[0]), cos(angles[0]), 0}, {0, 0, 1}};
+    double pole[3][3] = {{1, 0, 0}, {0, cos(angles[1]), sin(angles[1])}, {0, -sin(angles[1]), cos(angles[1])}};
+    double prime[3][3] = {{cos(angles[2]), sin(angles[2]), 0}, {-sin(angles[2]), cos(angles[2]), 0}, {0, 0, 1}};
+    double pole_node[3][3];
+    for (int row = 0; row < 3; row++) {
+        for (int column = 0; column < 3; column++) {
+            pole_node[row][column] = 0;
+            for (int k = 0; k < 3; k++) {
+                pole_node[row][column] += pole[row][k] * node[k][column];
+            }
+        }
+    }
+    for (int row = 0; row < 3; row++) {
+        for (int column = 0; column < 3; column++) {
+            outMatrix[row][column] = 0;
+            for (int k = 0; k < 3; k++) {
+                outMatrix[row][column] += prime[row][k] * pole_node[k][column];
+            }
+        }
+    }
+}
+
+int write_sun_directions(std::string ephemerisPath, std::string start, std::string end, double fps, bool rotateFlat, float centerLat,
+                         float centerLon, std::string outputPath) {
+    double start_seconds, end_seconds;
+    if (parse_utc(start, &start_seconds) || parse_utc(end, &end_seconds)) {
+        std::cout << "Times must be UTC in the form YYYY-MM-DD HH:MM:SS" << std::endl;
+        return 1;
+    }
+    if (end_seconds < start_seconds || fps <= 0) {
+        std::cout << "The sun animation must end after it starts and have a positive frame rate" << std::endl;
+        return 1;
+    }
+    SpkFile ephemeris;
+    if (ephemeris.open(ephemerisPath)) return 1;
+    std::ofstream file(outputPath);
+    if (!file.is_open()) {
+        std::cout << "Failed to open " << outputPath << std::endl;
+        return 1;
+    }
+
+    // a direction only needs the rotation of the mesh's transform, not its scale or offset
+    CartesianTransform flat = DEMManager::rotateFlatTransform(centerLat, centerLon, 0, 1);
+    int64_t frame_count = floor((end_seconds - start_seconds) * fps + 1e-6) + 1;
+    file.precision(9);
+    file << "frame,utc,sun_x,sun_y,sun_z,rot_x,rot_y,rot_z" << std::endl;
+    for (int64_t frame = 0; frame < frame_count; frame++) {
+        double unix_seconds = start_seconds + frame / fps;
+        double epoch = utc_to_epoch(unix_seconds);
+        double sun[3];
+        if (ephemeris.position(sun, NAIF_SUN, NAIF_MOON, epoch)) {
+            std::cout << ephemerisPath << " doesn't cover the Sun and Moon at " << format_utc(unix_seconds) << std::endl;
+            return 1;
+        }
+        double orientation[3][3];
+        moon_orientation(orientation, epoch);
+        double direction[3];
+        for (int row = 0; row < 3; row++) {
+            direction[row] = orientation[row][0] * sun[0] + orientation[row][1] * sun[1] + orientation[row][2] * sun[2];
+        }
+        if (rotateFlat) {
+            double body_fixed[3] = {direction[0], direction[1], direction[2]};
+            for (int row = 0; row < 3; row++) {
+                direction[row] = flat.matrix[row][0] * body_fixed[0] + flat.matrix[row][1] * body_fixed[1] + flat.matrix[row][2] * body_fixed[2];
+            }
+        }
+        double length = sqrt(direction[0] * direction[0] + direction[1] * direction[1] + direction[2] * direction[2]);
+        for (int axis = 0; axis < 3; axis++) {
+            direction[axis] /= length;
+        }
+        // the same euler angles moonsurface.py gives the Sun lamp
+        file << frame << "," << format_utc(unix_seconds) << "," << direction[0] << "," << direction[1] << "," << direction[2] << ","
+             << atan2(direction[1], direction[2]) << "," << atan2(direction[0], direction[2]) << "," << 0 << "\n";
+    }
+    file.close();
+    if (!file) {
+        std::cout << "Failed to write " << outputPath << std::endl;
+        return 1;
+    }
+    std::cout << "Wrote " << frame_count << " sun directions to " << outputPath << std::endl;
+    return 0;
+}
@@ -0,0 +1,62 @@
+#pragma once
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// NAIF ids of the bodies the sun direction is chained through
+enum NaifBody {
+    NAIF_SOLAR_SYSTEM_BARYCENTER = 0,
+    NAIF_EARTH_MOON_BARYCENTER = 3,
+    NAIF_SUN = 10,
+    NAIF_MOON = 301,
+};
+
+// a segment of an SPK file, giving the position of target relative to center between two epochs
+struct SpkSegment {
+    double startEpoch;
+    double endEpoch;
+    int target;
+    int center;
+    int type;
+    // first and last double of the segment's data, counted from 1 like DAF addresses
+    int startAddress;
+    int endAddress;
+};
+
+class SpkFile {
+    // a JPL SPK ephemeris (.bsp) mapped read only into memory. Only Chebyshev position segments (types 2 and 3) are read,
+    // which is what the DE planetary ephemerides are made of. A position is evaluated straight from the mapped
+    // coefficients, so it costs a segment lookup and a few dozen multiply adds
+    private:
+        const char *mapping;
+        size_t mappingSize;
+        std::vector<SpkSegment> segments;
+        const double *words() const {
+            return (const double *)this->mapping;
+        }
+        const SpkSegment *findSegment(int target, double epoch) const;
+        void segmentPosition(double outPosition[3], const SpkSegment &segment, double epoch) const;
+        int barycentricPosition(double outPosition[3], int body, double epoch) const;
+    public:
+        SpkFile();
+        ~SpkFile();
+        SpkFile(const SpkFile &) = delete;
+        SpkFile &operator=(const SpkFile &) = delete;
+        // returns 1 if the file can't be mapped or isn't a little endian SPK file
+        int open(std::string filename);
+        void close();
+        // position of target relative to center in km, in the ICRF, at epoch TDB seconds past J2000.
+        // returns 1 if the file doesn't cover one of the bodies at that epoch
+        int position(double outPosition[3], int target, int center, double epoch) const;
+};
+
+// parses a UTC time written YYYY-MM-DD HH:MM:SS into TDB seconds past J2000. Returns 1 if it can't be parsed
+int parse_utc_epoch(std::string text, double *outEpoch);
+// rotation from the ICRF into the Moon's body fixed frame, the one DEM latitudes and longitudes are measured in,
+// following the IAU 2009 model of the Moon's orientation
+void moon_orientation(double outMatrix[3][3], double epoch);
+// writes the direction of the Sun from the Moon for every frame from start to end, fps frames per second, as csv.
+// With rotateFlat the directions are in the same frame as a --rotate-flat mesh centered on centerLat, centerLon.
+// Returns 1 on failure
+int write_sun_directions(std::string ephemerisPath, std::string start, std::string end, double fps, bool rotateFlat, float centerLat,
+                         float centerLon, std::string outputPath);
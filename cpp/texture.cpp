@@ -0,0 +1,193 @@
+#include "texture.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include "gdal_priv.h"
+#include "cpl_conv.h"
+#include "cpl_vsi.h"
+#include "stats.h"
+
+// the crop is written in tiles of this many pixels on a side, so memory stays bounded however big the crop is
+static const int textureTileSize = 512;
+
+// the source texture is a global simple cylindrical image. Rows above the north pole or below the south pole
+// come from the other side of the pole: the row is mirrored back into the image and shifted by half the width
+static void source_row(int row, int texture_height, int texture_width, int *outRow, int *outShift) {
+    *outShift = 0;
+    if (row < 0) {
+        row = -1 - row;
+        *outShift = texture_width / 2;
+    } else if (row >= texture_height) {
+        row = 2 * texture_height - 1 - row;
+        *outShift = texture_width / 2;
+    }
+    *outRow = std::min(texture_height - 1, std::max(0, row));
+}
+
+// reads rows [first_row, first_row + rows) of every band, starting at first_column and wrapping across the antimeridian.
+// returns 1 if a read failed
+static int read_wrapped(GDALDataset *source, int first_column, int first_row, int width, int rows, char *buffer,
+                         GDALDataType type, int band_count, GSpacing line_space, GSpacing band_space) {
+    int texture_width = source->GetRasterXSize();
+    int type_size = GDALGetDataTypeSizeBytes(type);
+    int column = 0;
+    while (column < width) {
+        int source_column = ((first_column + column) % texture_width + texture_width) % texture_width;
+        int segment_width = std::min(width - column, texture_width - source_column);
+        RunStats::add(STAT_RASTER_IO_CALLS, 1);
+        if (source->RasterIO(GF_Read, source_column, first_row, segment_width, rows, buffer + (size_t)column * type_size,
+                             segment_width, rows, type, band_count, NULL, type_size, line_space, band_space) != CE_None) {
+            return 1;
+        }
+        column += segment_width;
+    }
+    return 0;
+}
+
+int create_texture(MoonSurfaceOptions meshOptions, WorkPool *pool) {
+    PhaseTimer textureTimer("texture");
+    std::cout << "Cropping texture" << std::endl;
+    GDALDataset *globalTexture = GDALDataset::FromHandle(GDALOpen(meshOptions.texture_path.c_str(), GA_ReadOnly));
+    if (globalTexture == NULL) {
+        std::cout << "Failed to open " << meshOptions.texture_path << std::endl;
+        return 1;
+    }
+    int band_count = globalTexture->GetRasterCount();
+    GDALDataType type = globalTexture->GetRasterBand(1)->GetRasterDataType();
+    int type_size = GDALGetDataTypeSizeBytes(type);
+
+    int texture_width = globalTexture->GetRasterXSize();
+    int texture_height = globalTexture->GetRasterYSize();
+
+    float min_lat_uv = meshOptions.min_latlon[0] / 180.0 + 0.5;
+    float min_lon_uv = meshOptions.min_latlon[1] / 360.0 + 0.5;
+
+    int cropped_width = meshOptions.latlon_extent[1] / 360.0f * texture_width;
+    int cropped_height = meshOptions.latlon_extent[0] / 180.0f * texture_height;
+    if (cropped_width <= 0 || cropped_height <= 0) {
+        std::cout << "Texture crop is empty" << std::endl;
+        GDALClose(globalTexture);
+        return 1;
+    }
+
+    // floor rather than truncate, since crops that start west of -180 have negative pixels
+    int min_lat_pixel = (int)floor(texture_height - min_lat_uv * texture_height);
+    int min_lon_pixel = (int)floor(min_lon_uv * texture_width);
+    int top_pixel = min_lat_pixel - cropped_height;
+
+    // the crop keeps every band in the source's own data type, in a tiled GeoTIFF
+    char **creationOptions = NULL;
+    creationOptions = CSLSetNameValue(creationOptions, "TILED", "YES");
+    creationOptions = CSLSetNameValue(creationOptions, "BLOCKXSIZE", "256");
+    creationOptions = CSLSetNameValue(creationOptions, "BLOCKYSIZE", "256");
+    creationOptions = CSLSetNameValue(creationOptions, "BIGTIFF", "IF_SAFER");
+    if (meshOptions.texture_compression != "NONE") {
+        creationOptions = CSLSetNameValue(creationOptions, "COMPRESS", meshOptions.texture_compression.c_str());
+    }
+    GDALDriver *driver = GetGDALDriverManager()->GetDriverByName("GTiff");
+    GDALDataset *croppedDataset = driver->Create((meshOptions.output + ".TIF").c_str(), cropped_width, cropped_height, band_count, type, creationOptions);
+    CSLDestroy(creationOptions);
+    if (croppedDataset == NULL) {
+        std::cout << "Failed to create " << meshOptions.output << ".TIF" << std::endl;
+        GDALClose(globalTexture);
+        return 1;
+    }
+
+    // a GDAL dataset can only be read by one thread at a time, so every worker opens its own copy of the source
+    std::vector<GDALDataset *> sources(pool->size(), NULL);
+    sources[0] = globalTexture;
+    std::mutex writeMutex;
+    // once a tile fails, the rest are skipped, since the texture is no good anyway
+    std::atomic<bool> failed(false);
+    int tiles_across = (cropped_width + textureTileSize - 1) / textureTileSize;
+    int tiles_down = (cropped_height + textureTileSize - 1) / textureTileSize;
+    pool->run((size_t)tiles_across * tiles_down, [&](size_t tile_idx, int worker) {
+        if (failed) {
+            return;
+        }
+        if (sources[worker] == NULL) {
+            sources[worker] = GDALDataset::FromHandle(GDALOpen(meshOptions.texture_path.c_str(), GA_ReadOnly));
+            if (sources[worker] == NULL) {
+                failed = true;
+                return;
+            }
+        }
+        GDALDataset *source = sources[worker];
+        int first_column = (tile_idx % tiles_across) * textureTileSize;
+        int first_row = (tile_idx / tiles_across) * textureTileSize;
+        int tile_width = std::min(textureTileSize, cropped_width - first_column);
+        int tile_height = std::min(textureTileSize, cropped_height - first_row);
+        GSpacing line_space = (GSpacing)tile_width * type_size;
+        GSpacing band_space = line_space * tile_height;
+        static thread_local std::vector<char> buffer;
+        buffer.resize((size_t)band_space * band_count);
+
+        // read runs of rows that come from one contiguous range of source rows with the same shift.
+        // past the poles the source rows run backwards, so those runs are flipped after reading
+        int row = 0;
+        while (row < tile_height) {
+            int run_start_row, shift;
+            source_row(top_pixel + first_row + row, texture_height, texture_width, &run_start_row, &shift);
+            int run_length = 1;
+            int direction = 0;
+            while (row + run_length < tile_height) {
+                int next_row, next_shift;
+                source_row(top_pixel + first_row + row + run_length, texture_height, texture_width, &next_row, &next_shift);
+                int step = next_row - (run_start_row + direction * (run_length - 1));
+                if (next_shift != shift || (step != 1 && step != -1) || (direction != 0 && step != direction)) {
+                    break;
+                }
+                direction = step;
+                run_length++;
+            }
+            int run_first_source_row = direction < 0 ? run_start_row - (run_length - 1) : run_start_row;
+            char *run_buffer = buffer.data() + (size_t)row * line_space;
+            if (read_wrapped(source, min_lon_pixel + first_column + shift, run_first_source_row, tile_width, run_length,
+                             run_buffer, type, band_count, line_space, band_space)) {
+                failed = true;
+                return;
+            }
+            if (direction < 0) {
+                std::vector<char> swap_row(line_space);
+                for (int band = 0; band < band_count; band++) {
+                    char *band_buffer = run_buffer + (size_t)band * band_space;
+                    for (int top = 0, bottom = run_length - 1; top < bottom; top++, bottom--) {
+                        memcpy(swap_row.data(), band_buffer + (size_t)top * line_space, line_space);
+                        memcpy(band_buffer + (size_t)top * line_space, band_buffer + (size_t)bottom * line_space, line_space);
+                        memcpy(band_buffer + (size_t)bottom * line_space, swap_row.data(), line_space);
+                    }
+                }
+            }
+            row += run_length;
+        }
+
+        std::lock_guard<std::mutex> lock(writeMutex);
+        if (croppedDataset->RasterIO(GF_Write, first_column, first_row, tile_width, tile_height, buffer.data(), tile_width, tile_height,
+                                     type, band_count, NULL, type_size, line_space, band_space) != CE_None) {
+            failed = true;
+        }
+    });
+
+    if (!failed) {
+        std::cout << "Saving texture" << std::endl;
+        croppedDataset->FlushCache();
+    }
+    GDALClose(croppedDataset);
+    for (GDALDataset *source : sources) {
+        if (source != NULL) {
+            GDALClose(source);
+        }
+    }
+    if (failed) {
+        std::cout << "Failed to crop " << meshOptions.texture_path << " into " << meshOptions.output << ".TIF" << std::endl;
+        return 1;
+    }
+    VSIStatBufL croppedStat;
+    if (VSIStatL((meshOptions.output + ".TIF").c_str(), &croppedStat) == 0) {
+        RunStats::add(STAT_BYTES_WRITTEN, croppedStat.st_size);
+    }
+    return 0;
+}
@@ -0,0 +1,114 @@
+#include "workpool.h"
+#include <thread>
+
+int WorkPool::resolveThreadCount(int requested) {
+    if (requested > 0) {
+        return requested;
+    }
+    int hardware_threads = std::thread::hardware_concurrency();
+    return hardware_threads > 0 ? hardware_threads : 1;
+}
+
+WorkPool::WorkPool(int threadCount) {
+    threadCount = WorkPool::resolveThreadCount(threadCount);
+    this->queued = 0;
+    this->stopping = false;
+    this->threads.resize(threadCount);
+    this->workerStates.resize(threadCount);
+    for (int worker = 0; worker < threadCount; worker++) {
+        this->queues.push_back(std::unique_ptr<Queue>(new Queue()));
+    }
+    for (int worker = 0; worker < threadCount; worker++) {
+        this->workerStates[worker].pool = this;
+        this->workerStates[worker].worker = worker;
+        pthread_create(&this->threads[worker], NULL, WorkPool::worker_thread, &this->workerStates[worker]);
+    }
+}
+
+WorkPool::~WorkPool() {
+    {
+        std::lock_guard<std::mutex> lock(this->sleepMutex);
+        this->stopping = true;
+    }
+    this->wake.notify_all();
+    for (pthread_t thread : this->threads) {
+        pthread_join(thread, NULL);
+    }
+}
+
+int WorkPool::size() {
+    return this->threads.size();
+}
+
+void WorkPool::run(size_t count, std::function<void(size_t, int)> task) {
+    if (count == 0) {
+        return;
+    }
+    Batch batch;
+    batch.task = task;
+    batch.remaining = count;
+
+    // count the tasks before any of them can be taken, so takeTask never decrements queued below zero
+    {
+        std::lock_guard<std::mutex> lock(this->sleepMutex);
+        this->queued += count;
+    }
+    // worker w starts with the run [w * count / workers, (w + 1) * count / workers)
+    size_t workers = this->queues.size();
+    for (size_t worker = 0; worker < workers; worker++) {
+        size_t first = worker * count / workers;
+        size_t last = (worker + 1) * count / workers;
+        std::lock_guard<std::mutex> lock(this->queues[worker]->mutex);
+        for (size_t index = first; index < last; index++) {
+            this->queues[worker]->tasks.push_back(Task{&batch, index});
+        }
+    }
+    this->wake.notify_all();
+
+    std::unique_lock<std::mutex> lock(batch.doneMutex);
+    batch.done.wait(lock, [&batch] { return batch.remaining == 0; });
+}
+
+// a worker takes from the front of its own queue, and steals from the back of the others
+bool WorkPool::takeTask(int worker, Task *outTask) {
+    int workers = this->queues.size();
+    for (int offset = 0; offset < workers; offset++) {
+        Queue &queue = *this->queues[(worker + offset) % workers];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.tasks.empty()) {
+            continue;
+        }
+        if (offset == 0) {
+            *outTask = queue.tasks.front();
+            queue.tasks.pop_front();
+        } else {
+            *outTask = queue.tasks.back();
+            queue.tasks.pop_back();
+        }
+        this->queued--;
+        return true;
+    }
+    return false;
+}
+
+void *WorkPool::worker_thread(void *state) {
+    WorkerState *workerState = (WorkerState *) state;
+    WorkPool *pool = workerState->pool;
+    while (true) {
+        Task task;
+        if (pool->takeTask(workerState->worker, &task)) {
+            task.batch->task(task.index, workerState->worker);
+            // the batch lives on the stack of run(), so it must be notified while its mutex is held
+            std::lock_guard<std::mutex> lock(task.batch->doneMutex);
+            if (--task.batch->remaining == 0) {
+                task.batch->done.notify_all();
+            }
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(pool->sleepMutex);
+        pool->wake.wait(lock, [pool] { return pool->stopping || pool->queued > 0; });
+        if (pool->stopping && pool->queued == 0) {
+            return NULL;
+        }
+    }
+}
@@ -0,0 +1,54 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <pthread.h>
+
+class WorkPool {
+    // a fixed set of worker threads that run batches of indexed tasks.
+    // each batch is dealt out to the workers in contiguous runs, so neighbouring tasks stay on the same thread,
+    // and a worker that runs out of tasks steals from the far end of another worker's queue
+    private:
+        struct Batch {
+            std::function<void(size_t, int)> task;
+            std::atomic<size_t> remaining;
+            std::mutex doneMutex;
+            std::condition_variable done;
+        };
+        struct Task {
+            Batch *batch;
+            size_t index;
+        };
+        struct Queue {
+            std::mutex mutex;
+            std::deque<Task> tasks;
+        };
+        struct WorkerState {
+            WorkPool *pool;
+            int worker;
+        };
+        std::vector<pthread_t> threads;
+        std::vector<WorkerState> workerStates;
+        std::vector<std::unique_ptr<Queue>> queues;
+        std::mutex sleepMutex;
+        std::condition_variable wake;
+        std::atomic<size_t> queued;
+        bool stopping;
+        static void *worker_thread(void *state);
+        bool takeTask(int worker, Task *outTask);
+    public:
+        // 0 threads means one per hardware thread
+        static int resolveThreadCount(int requested);
+        WorkPool(int threadCount);
+        ~WorkPool();
+        int size();
+        // runs task(index, worker) for every index in [0, count) and waits for them to finish.
+        // worker is in [0, size()), so tasks can keep per worker scratch space.
+        // several threads may call run at once, but tasks must not call run themselves
+        void run(size_t count, std::function<void(size_t, int)> task);
+};
@@ -111,20 +111,75 @@ def create_mesh_file(center_lat_lon, angular_extents, img_path, outfile, use_off
         pickle.dump({"sun_rot": sun_rot}, f)
 
 
-def create_moon(meshfile="moon_mesh"):
+PLY_TYPES = {"char": "i1", "uchar": "u1", "short": "<i2", "ushort": "<u2", "int": "<i4", "uint": "<u4",
+             "float": "<f4", "double": "<f8"}
+
+def read_ply(ply_path):
+    """Maps the vertices and faces of a binary PLY written by MoonSurface --format ply.
+    Returns the vertex records as a numpy structured array and the face corners as a (faces, corners) index array"""
+    import numpy as np
+    elements = []
+    with open(ply_path, "rb") as ply_file:
+        if ply_file.readline().strip() != b"ply":
+            raise ValueError(f"{ply_path} is not a PLY file")
+        while True:
+            words = ply_file.readline().decode("ascii").split()
+            if not words:
+                raise ValueError(f"{ply_path} has no end_header")
+            if words[0] == "format" and words[1] != "binary_little_endian":
+                raise ValueError(f"{ply_path} is {words[1]}, only binary_little_endian is supported")
+            if words[0] == "element":
+                elements.append({"name": words[1], "count": int(words[2]), "properties": []})
+            if words[0] == "property":
+                elements[-1]["properties"].append(words[1:])
+            if words[0] == "end_header":
+                break
+        offset = ply_file.tell()
+        elements = {element["name"]: element for element in elements}
+        vertex_dtype = np.dtype([(name, PLY_TYPES[kind]) for kind, name in elements["vertex"]["properties"]])
+        face_count = elements["face"]["count"]
+        _, _, count_kind, index_kind, _ = elements["face"]["properties"][0]
+        # every face has the same number of corners, so the first face's count gives the size of all of them
+        ply_file.seek(offset + vertex_dtype.itemsize * elements["vertex"]["count"])
+        corners = int(np.frombuffer(ply_file.read(np.dtype(PLY_TYPES[count_kind]).itemsize), PLY_TYPES[count_kind])[0]) if face_count else 3
+    vertices = np.memmap(ply_path, dtype=vertex_dtype, mode="r", offset=offset, shape=(elements["vertex"]["count"],))
+    face_dtype = np.dtype([("count", PLY_TYPES[count_kind]), ("indices", PLY_TYPES[index_kind], (corners,))])
+    faces = np.memmap(ply_path, dtype=face_dtype, mode="r", offset=offset + vertex_dtype.itemsize * len(vertices), shape=(face_count,))
+    if np.any(faces["count"] != corners):
+        raise ValueError(f"{ply_path} mixes faces with different numbers of corners")
+    return vertices, faces["indices"]
+
+def load_ply_mesh(moon_mesh, ply_path):
+    """Fills moon_mesh from a binary PLY, handing whole numpy buffers to foreach_set instead of building python lists"""
     import bpy
-    import pickle
-    import os
+    import numpy as np
+    vertices, face_indices = read_ply(ply_path)
+    face_count, corners = face_indices.shape
+    print(f"Mesh contains {len(vertices)} vertices")
+    # blender stores vertex and loop indices as int32, so larger meshes can't be loaded without wrapping
+    int32_max = np.iinfo(np.int32).max
+    if len(vertices) > int32_max or face_count * corners > int32_max:
+        raise ValueError(f"{ply_path} has {len(vertices)} vertices and {face_count * corners} face corners, blender holds at most {int32_max} of each")
+    # the records interleave positions and uvs, so each is gathered into its own contiguous buffer once
+    positions = np.column_stack((vertices["x"], vertices["y"], vertices["z"]))
+    loop_vertices = np.ascontiguousarray(face_indices, dtype=np.int32).ravel()
+    moon_mesh.vertices.add(len(vertices))
+    moon_mesh.vertices.foreach_set("co", positions.ravel())
+    moon_mesh.loops.add(len(loop_vertices))
+    moon_mesh.loops.foreach_set("vertex_index", loop_vertices)
+    moon_mesh.polygons.add(face_count)
+    moon_mesh.polygons.foreach_set("loop_start", np.arange(0, len(loop_vertices), corners, dtype=np.int32))
+    if bpy.app.version < (4, 0, 0):
+        moon_mesh.polygons.foreach_set("loop_total", np.full(face_count, corners, dtype=np.int32))
+    # uvs belong to the loops in blender, so every corner takes its vertex's uv
+    uvs = np.column_stack((vertices["s"], vertices["t"]))
+    moon_uv = moon_mesh.uv_layers.new(name="UVMap")
+    moon_uv.data.foreach_set("uv", uvs[loop_vertices].ravel())
+    moon_mesh.update(calc_edges=True)
 
-    if "MoonMesh" in bpy.data.meshes:
-        bpy.data.meshes.remove(bpy.data.meshes["MoonMesh"])
-    if "MoonObject" in bpy.data.objects:
-        bpy.data.objects.remove(bpy.data.objects["MoonObject"])
-    with open(os.path.join(os.path.dirname(__file__), f"{meshfile}.pkl"), "rb") as f:
-        mesh = pickle.load(f)
-    
-    moon_mesh = bpy.data.meshes.new("MoonMesh")
-    with open(os.path.join(os.path.dirname(__file__), f"{meshfile}.mesh")) as cpp_output:
+def load_text_mesh(moon_mesh, mesh_path):
+    """Fills moon_mesh from the older text .mesh format"""
+    with open(mesh_path) as cpp_output:
         meshlines = cpp_output.read().splitlines()
         vertices_width, vertices_height = [int(x) for x in meshlines[0].split(" ")]
         faces_width = vertices_width - 1
@@ -139,7 +194,68 @@ def create_moon(meshfile="moon_mesh"):
         faces = [[int(x) for x in line.split(" ")] for line in faces_lines]
         print(f"Mesh contains {len(vertices)} vertices")
         moon_mesh.from_pydata(vertices, edges, faces)
-            
+
+    # Loops per face
+    moon_uv = moon_mesh.uv_layers.new(name="UVMap")
+    # the lower left corner of the uv map for the whole mesh
+    base_uv = (0,0)
+    # the upper right corner of the uv map for the whole mesh
+    extent_uv = (1,1)
+
+    # for each face, calculate the uv coordinates
+    for face in moon_mesh.polygons:
+        # the face index
+        face_idx = face.index
+        # the face's width index
+        face_width_idx = face_idx % faces_width
+        # the face's height index
+        face_height_idx = face_idx // faces_width
+        # the lower left corner of the face's uv map
+        face_base_uv = (base_uv[0] + face_width_idx / (faces_width + 1) * (extent_uv[0] - base_uv[0]), base_uv[1] + face_height_idx / (faces_height + 1) * (extent_uv[1] - base_uv[1]))
+        # the upper right corner of the face's uv map
+        face_extent_uv = (base_uv[0] + (face_width_idx + 1) / (faces_width + 1) * (extent_uv[0] - base_uv[0]), base_uv[1] + (face_height_idx + 1) / (faces_height + 1) * (extent_uv[1] - base_uv[1]))
+        # the face's uv coordinates
+        face_uv = [face_base_uv, (face_extent_uv[0], face_base_uv[1]), face_extent_uv, (face_base_uv[0], face_extent_uv[1])]
+        
+        # assign the uv coordinates to the face
+        for loop_idx, loop in enumerate(face.loop_indices):
+            moon_uv.data[loop].uv = face_uv[loop_idx]
+
+def animate_sun(sun_object, sun_path):
+    """Keyframes the sun's rotation on every frame of a MoonSurface --sun-ephemeris table"""
+    import bpy
+    import numpy as np
+    table = np.atleast_1d(np.genfromtxt(sun_path, delimiter=",", names=True, dtype=None, encoding="ascii"))
+    frames = table["frame"] + bpy.context.scene.frame_start
+    sun_object.animation_data_clear()
+    action = bpy.data.actions.new(name="SunAction")
+    sun_object.animation_data_create().action = action
+    for axis, column in enumerate(("rot_x", "rot_y", "rot_z")):
+        curve = action.fcurves.new("rotation_euler", index=axis)
+        curve.keyframe_points.add(len(table))
+        curve.keyframe_points.foreach_set("co", np.column_stack((frames, table[column])).astype(np.float32).ravel())
+        curve.update()
+    bpy.context.scene.frame_end = int(frames[-1])
+
+def create_moon(meshfile="moon_mesh"):
+    import bpy
+    import pickle
+    import os
+
+    if "MoonMesh" in bpy.data.meshes:
+        bpy.data.meshes.remove(bpy.data.meshes["MoonMesh"])
+    if "MoonObject" in bpy.data.objects:
+        bpy.data.objects.remove(bpy.data.objects["MoonObject"])
+    with open(os.path.join(os.path.dirname(__file__), f"{meshfile}.pkl"), "rb") as f:
+        mesh = pickle.load(f)
+    
+    moon_mesh = bpy.data.meshes.new("MoonMesh")
+    ply_path = os.path.join(os.path.dirname(__file__), f"{meshfile}.ply")
+    if os.path.exists(ply_path):
+        load_ply_mesh(moon_mesh, ply_path)
+    else:
+        load_text_mesh(moon_mesh, os.path.join(os.path.dirname(__file__), f"{meshfile}.mesh"))
+
     moon_object = bpy.data.objects.new("MoonObject", moon_mesh)
     bpy.context.collection.objects.link(moon_object)
     moonmesh_texture_filename = f"{meshfile}.png"
@@ -168,32 +284,6 @@ def create_moon(meshfile="moon_mesh"):
     # if the material already exists, check if the texture needs to be updated
     if moon_object.active_material.node_tree.nodes["Image Texture"].image != bpy.data.images[moonmesh_texture_filename]:
         moon_object.active_material.node_tree.nodes["Image Texture"].image = bpy.data.images[moonmesh_texture_filename]
-    # Loops per face
-    moon_uv = moon_mesh.uv_layers.new(name="UVMap")
-    # the lower left corner of the uv map for the whole mesh
-    base_uv = (0,0)
-    # the upper right corner of the uv map for the whole mesh
-    extent_uv = (1,1)
-
-    # for each face, calculate the uv coordinates
-    for face in moon_mesh.polygons:
-        # the face index
-        face_idx = face.index
-        # the face's width index
-        face_width_idx = face_idx % faces_width
-        # the face's height index
-        face_height_idx = face_idx // faces_width
-        # the lower left corner of the face's uv map
-        face_base_uv = (base_uv[0] + face_width_idx / (faces_width + 1) * (extent_uv[0] - base_uv[0]), base_uv[1] + face_height_idx / (faces_height + 1) * (extent_uv[1] - base_uv[1]))
-        # the upper right corner of the face's uv map
-        face_extent_uv = (base_uv[0] + (face_width_idx + 1) / (faces_width + 1) * (extent_uv[0] - base_uv[0]), base_uv[1] + (face_height_idx + 1) / (faces_height + 1) * (extent_uv[1] - base_uv[1]))
-        # the face's uv coordinates
-        face_uv = [face_base_uv, (face_extent_uv[0], face_base_uv[1]), face_extent_uv, (face_base_uv[0], face_extent_uv[1])]
-        
-        # assign the uv coordinates to the face
-        for loop_idx, loop in enumerate(face.loop_indices):
-            moon_uv.data[loop].uv = face_uv[loop_idx]
-    
     # set the angle of the sun
     if "Sun" in bpy.data.objects:
         bpy.data.objects["Sun"].rotation_euler = mesh["sun_rot"][0], mesh["sun_rot"][1], mesh["sun_rot"][2]
@@ -206,6 +296,11 @@ def create_moon(meshfile="moon_mesh"):
         sunobject.data.energy = 1360
         sunobject.data.angle = math.radians(0.526)
 
+    # a table of sun directions from MoonSurface --sun-ephemeris animates the sun over the whole time range
+    sun_path = os.path.join(os.path.dirname(__file__), f"{meshfile}_sun.csv")
+    if os.path.exists(sun_path):
+        animate_sun(bpy.data.objects["Sun"], sun_path)
+
 if __name__ == "__main__":
     import argparse
     parser = argparse.ArgumentParser(description='Create a mesh from a DEM')